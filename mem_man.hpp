@@ -1,12 +1,78 @@
 #pragma once
 
 #include <list>
+#include <vector>
+#include <new>
+#include <type_traits>
 #include <functional>
 #include <assert.h>
 #include <exception>
 #include <algorithm>
 #include <iostream>
 #include <typeinfo>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <string>
+#include <map>
+#include <unordered_map>
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD_SCAN)
+#include <immintrin.h>
+#define SIMD_SCAN_X86
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define ASAN_ENABLED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ASAN_ENABLED
+#endif
+#endif
+
+#ifdef ASAN_ENABLED
+#include <sanitizer/asan_interface.h>
+#define POISON_MEMORY(addr, size)   ASAN_POISON_MEMORY_REGION(addr, size)
+#define UNPOISON_MEMORY(addr, size) ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+#define POISON_MEMORY(addr, size)   ((void)(addr), (void)(size))
+#define UNPOISON_MEMORY(addr, size) ((void)(addr), (void)(size))
+#endif
+
+#ifdef PERSISTENT_HEAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <memory>
+#include <cstring>
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <optional>
+#include <tuple>
+#define COROUTINES_ENABLED
+#endif
+
+#ifdef SHARED_POOL
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#endif
+
+#ifdef HARDENED
+#include <cstring>
+#include <cstdlib>
+#define MAKE_POINTER_ATTR __attribute__((noinline))
+#else
+#define MAKE_POINTER_ATTR
+#endif
 
 using size_t = unsigned long;
 
@@ -53,6 +119,24 @@ using size_t = unsigned long;
 #define THRESHOLD 80
 #endif
 
+#ifdef HEAP_PROFILE
+#include <execinfo.h>
+#include <random>
+#ifndef HEAP_SAMPLE_RATE // average bytes allocated between two sampled objects
+#define HEAP_SAMPLE_RATE 512 * KB
+#endif
+#endif
+
+// CHECK_INVARIANTS verifies the bookkeeping of every chunk after each sweep, for the stress tests.
+
+#ifndef CGROUP_MEM_SHARE // percent of the cgroup limit managed memory may take, reserve included
+#define CGROUP_MEM_SHARE 90
+#endif
+
+#ifndef RESERVE_CHUNKS // chunks worth of memory held back past the hard limit for emergencies
+#define RESERVE_CHUNKS 1
+#endif
+
 #include "tests/benchmark.hpp"
 
 namespace memman {
@@ -60,6 +144,98 @@ namespace memman {
   template <typename Tobj>
   class Pointer;
 
+#ifdef PERSISTENT_HEAP
+  /**
+   * @brief Reference to an object of a persistent heap that survives restarts: the object's offset
+   * in the heap file. Objects of a persistent heap refer to each other through handles.
+   */
+  template <typename Tobj>
+  struct Handle {
+    uint64_t offset = 0;
+
+    bool IsNull(void) const { return offset == 0; }
+  };
+#endif
+
+  /**
+   * @brief How close memory is to its limits when pressure callbacks are invoked.
+   * Soft: past the soft limit, Hard: at the hard limit, Critical: the emergency reserve is in use.
+   */
+  enum class PressureLevel { Soft, Hard, Critical };
+
+  /**
+   * @brief What an allocation does when the hard limit is reached and a sweep freed nothing.
+   * NonBlocking fails right away, Blocking keeps sweeping and notifying until its timeout expires.
+   * Managers are single threaded, so while an allocation blocks only its pressure callbacks can
+   * free anything: Blocking suits callbacks that release more as time passes, such as caches
+   * expiring entries.
+   */
+  enum class AllocationMode { NonBlocking, Blocking };
+
+  /**
+   * @brief Tenant objects are charged to, 0 being the default tenant that has no quota.
+   */
+  using TenantId = uint32_t;
+
+  /**
+   * @brief What a quota level does once it goes past its soft limit.
+   * Own sweeps only the level's memory, Global sweeps every manager, None goes straight on to the hard limit.
+   * A tenant's Own sweep reclaims only the released objects the tenant allocated.
+   */
+  enum class SweepPolicy { Own, Global, None };
+
+  /**
+   * @brief Limits of one quota level, in bytes. Types are charged their chunks, bookkeeping included, tenants their objects.
+   */
+  struct Quota {
+    size_t soft = ~size_t(0);
+    size_t hard = ~size_t(0);
+    SweepPolicy policy = SweepPolicy::Own;
+  };
+
+  /**
+   * @brief Accounting of one quota level.
+   */
+  struct LevelStats {
+    size_t bytes = 0;
+    size_t objects = 0;
+    size_t soft = ~size_t(0);
+    size_t hard = ~size_t(0);
+    size_t sweeps = 0;  // Sweeps run because the level went past its limits
+    size_t denials = 0; // Allocations refused at the level's hard limit
+  };
+
+  /**
+   * @brief Accounting of every quota level: global, per type (by type name) and per tenant.
+   */
+  struct MemoryStats {
+    LevelStats global;
+    std::map<std::string, LevelStats> types;
+    std::map<TenantId, LevelStats> tenants;
+  };
+
+  namespace detail {
+
+    /**
+     * @brief What a Pointer needs to know about the slot its object lives in. Pointer is public,
+     * so this has to have external linkage too.
+     */
+    struct SlotRef {
+      uint32_t* count = nullptr;
+      uint64_t* released = nullptr; // Chunk bitmap word flagged when the count drops to zero
+      uint64_t released_mask = 0;
+#ifdef HARDENED
+      const uint32_t* generation = nullptr; // Bumped every time the slot is reclaimed
+      uint32_t tag = 0;                     // Generation the object was allocated in
+#endif
+#ifdef PERSISTENT_HEAP
+      uint32_t* pins = nullptr; // Handle references, only for objects of a persistent heap
+      uint64_t offset = 0;      // Offset of the object in the heap file
+#endif
+    };
+
+  } // namespace detail
+
   namespace {
 
     class MemoryException : public std::exception {
@@ -78,6 +254,53 @@ namespace memman {
       virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return "Memory chunk is full"; }
     };
 
+    class MemoryLimitException : public MemoryException {
+    public:
+      MemoryLimitException() = default;
+      ~MemoryLimitException() override = default;
+
+      virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return "Memory limit reached"; }
+    };
+
+#ifdef SHARED_POOL
+    class SharedPoolException : public MemoryException {
+    public:
+      SharedPoolException(const char* reason) : reason_(reason) {}
+      ~SharedPoolException() override = default;
+
+      virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return reason_; }
+
+    private:
+      const char* reason_;
+    };
+#endif
+
+#ifdef PERSISTENT_HEAP
+    class PersistentHeapException : public MemoryException {
+    public:
+      PersistentHeapException(const char* reason) : reason_(reason) {}
+      ~PersistentHeapException() override = default;
+
+      virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return reason_; }
+
+    private:
+      const char* reason_;
+    };
+#endif
+
+#ifdef CHECK_INVARIANTS
+    class InvariantException : public MemoryException {
+    public:
+      InvariantException(const char* reason) : reason_(reason) {}
+      ~InvariantException() override = default;
+
+      virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return reason_; }
+
+    private:
+      const char* reason_;
+    };
+#endif
+
     class UnavailableChunksException : public MemoryException {
     public:
       UnavailableChunksException() = default;
@@ -86,271 +309,1543 @@ namespace memman {
       virtual const char* what() const _GLIBCXX_TXN_SAFE_DYN _GLIBCXX_NOTHROW { return "No non-full memory chunk available"; }
     };
 
-    template<class Tobj>
-    class MemoryChunk final {
+#ifdef HEAP_PROFILE
+    /**
+     * @brief Sampling heap profiler. Roughly one object every sample rate bytes gets its allocation
+     * stack recorded (the distance between samples is exponentially distributed, so every byte is
+     * equally likely to be picked) and is tracked until a sweep reclaims it.
+     */
+    class HeapProfiler final {
     public:
-      using CountControler = std::function<void(int)>;
-      class Iterator;
+      using Stack = std::vector<void*>;
 
+      static constexpr int kMaxFrames = 64;
     public:
-      MemoryChunk() {
-        Init();
-        for (size_t i = 0; i < chunk_popul_; i++)
-          assert(cnt_ctrl_[i] != nullptr);
+      static auto Get(void) -> HeapProfiler& {
+        static HeapProfiler singleton;
+        return singleton;
       }
-      ~MemoryChunk() {
-        for (int i = 0; i < chunk_popul_; i++) {
-          if (chunk_[i] != nullptr)
-            delete chunk_[i];
+
+      // Called on every allocation, so the countdown is checked without going through Get().
+      static bool ShouldSample(size_t size) {
+        if (__builtin_expect((bytes_until_sample_ -= int64_t(size)) > 0, 1))
+          return false;
+        return Get().TakeSample();
+      }
+
+      void RecordAllocation(const void* obj, size_t size) {
+        void* frames[kMaxFrames];
+        int depth = backtrace(frames, kMaxFrames);
+        auto site = sites_.emplace(Stack(frames + 1, frames + depth), Site()).first;
+        site->second.alloc_count++;
+        site->second.alloc_bytes += size;
+        site->second.live_count++;
+        site->second.live_bytes += size;
+        live_[obj] = { site, size };
+      }
+
+      void RecordFree(const void* obj) {
+        auto iter = live_.find(obj);
+        if (iter == live_.end())
+          return;
+        iter->second.site->second.live_count--;
+        iter->second.site->second.live_bytes -= iter->second.size;
+        live_.erase(iter);
+      }
+
+      void SetSampleRate(size_t bytes) {
+        sample_rate_ = bytes;
+        bytes_until_sample_ = NextSampleInterval();
+      }
+
+      /**
+       * @brief Writes the samples in the legacy pprof heap format (heap_v2), which pprof unsamples
+       * using the sample rate in the header.
+       */
+      void Dump(std::ostream& os) {
+        Site total;
+        for (auto& site : sites_)
+          total += site.second;
+        os << "heap profile: " << total << " @ heap_v2/" << sample_rate_ << '\n';
+        for (auto& site : sites_) {
+          os << site.second << " @";
+          for (void* pc : site.first)
+            os << ' ' << pc;
+          os << '\n';
         }
-        delete[] chunk_;
-        delete[] counters_;
-        delete[] cnt_ctrl_;
+        os << "\nMAPPED_LIBRARIES:\n";
+        std::ifstream maps("/proc/self/maps");
+        os << maps.rdbuf();
       }
 
-      template<typename... Args>
-      auto Allocate(Args&&... args) -> Iterator {
-        int index = free_space_.front();
-        if (chunk_[index] != nullptr) {
-          Tobj obj(args...);
-          *(chunk_[index]) = obj;
+    private:
+      struct Site {
+        size_t live_count = 0;
+        size_t live_bytes = 0;
+        size_t alloc_count = 0;
+        size_t alloc_bytes = 0;
+
+        auto operator+=(const Site& other) -> Site& {
+          live_count += other.live_count;
+          live_bytes += other.live_bytes;
+          alloc_count += other.alloc_count;
+          alloc_bytes += other.alloc_bytes;
+          return *this;
         }
-        else {
-          chunk_[index] = new Tobj(std::forward<Args>(args)...);
+        friend auto operator<<(std::ostream& os, const Site& s) -> std::ostream& {
+          return os << s.live_count << ": " << s.live_bytes << " [" << s.alloc_count << ": " << s.alloc_bytes << ']';
         }
-        counters_[index] = 1;
-        free_space_.pop_front();
-        managed_space_.emplace_back(index);
+      };
+      struct LiveObject {
+        std::map<Stack, Site>::iterator site;
+        size_t size;
+      };
 
-        return Iterator(chunk_[index], counters_[index], cnt_ctrl_[index]);
+      static inline int64_t bytes_until_sample_ = 0;
+      size_t sample_rate_ = HEAP_SAMPLE_RATE;
+      std::mt19937_64 rng_{ std::random_device()() };
+      std::map<Stack, Site> sites_;
+      std::unordered_map<const void*, LiveObject> live_;
+
+      bool TakeSample(void) {
+        bytes_until_sample_ = NextSampleInterval();
+        return sample_rate_ != 0;
       }
 
-      void SweepManagedMem(void) {
-        for (int i = 0; i < chunk_popul_ && !managed_space_.empty(); i++) {
-          if (counters_[i] == 0) {
-            auto iter = std::find(managed_space_.begin(), managed_space_.end(), i);
-            free_space_.emplace_back(*iter);
-            managed_space_.erase(iter);
-          }
-        }
+      auto NextSampleInterval(void) -> int64_t {
+        if (sample_rate_ == 0)
+          return INT64_MAX;
+        return int64_t(std::exponential_distribution<double>(1.0 / sample_rate_)(rng_)) + 1;
       }
 
-      bool IsFull(void) { return managed_space_.size() == chunk_popul_ ? true : false; }
-      bool IsEmpty(void) { return managed_space_.size() == 0; }
-      auto Size(void) -> size_t { return managed_space_.size(); }
-      auto Population(void) -> size_t { return chunk_popul_; }
+      HeapProfiler() { bytes_until_sample_ = NextSampleInterval(); }
+      HeapProfiler(const HeapProfiler&) = delete;
+      HeapProfiler(HeapProfiler&&) = delete;
+      ~HeapProfiler() = default;
+    };
+#endif
 
-      class Iterator {
-      public:
-        Iterator(Tobj* _obj, size_t _counter, const CountControler& _ctrl) : obj_(_obj), counter_(_counter), ctrl_(_ctrl) {}
-        ~Iterator() = default;
+    /**
+     * @brief Word scanning kernels over the chunk bitmaps. The widest kernel the CPU supports
+     * is picked once at runtime, NO_SIMD_SCAN forces the scalar one.
+     */
+    namespace bitscan {
+      using Word = uint64_t;
+      using Kernel = size_t(*)(const Word*, size_t, size_t, Word);
 
-        auto GetPointer(void) const -> Tobj* { return obj_; }
-        auto GetCount(void) const -> size_t { return counter_; }
-        auto GetCntCtrl(void) const -> const CountControler& { return ctrl_; }
+      constexpr size_t kWordBits = 64;
 
-      private:
-        Tobj* obj_;
-        size_t counter_;
-        const CountControler& ctrl_;
-      };
+      size_t FindWordNotEqualScalar(const Word* words, size_t from, size_t n, Word value) {
+        for (; from < n; from++) {
+          if (words[from] != value)
+            return from;
+        }
+        return n;
+      }
 
-      friend auto operator<<(std::ostream& os, const MemoryChunk& ch) -> std::ostream& {
-        for (int i = 0; i < ch.chunk_popul_; i++) {
-          bool free = std::find(ch.free_space_.begin(), ch.free_space_.end(), i) != ch.free_space_.end();
-          os << typeid(ch.chunk_[i]).name() << "   " << ch.chunk_[i] << "   " << ch.counters_[i] << "   " << free << "   " << !free << '\n';
+#ifdef SIMD_SCAN_X86
+      __attribute__((target("sse2")))
+        size_t FindWordNotEqualSse2(const Word* words, size_t from, size_t n, Word value) {
+        const __m128i v = _mm_set1_epi64x(value);
+        for (; from + 2 <= n; from += 2) {
+          __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(words + from));
+          if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, v)) != 0xFFFF)
+            break;
         }
-        return os;
+        return FindWordNotEqualScalar(words, from, n, value);
       }
 
-    private:
-      size_t chunk_popul_ = CHUNK_SIZE / sizeof(Tobj);
-      Tobj** chunk_;
-      size_t* counters_;
-      CountControler* cnt_ctrl_;
+      __attribute__((target("avx2")))
+        size_t FindWordNotEqualAvx2(const Word* words, size_t from, size_t n, Word value) {
+        const __m256i v = _mm256_set1_epi64x(value);
+        for (; from + 4 <= n; from += 4) {
+          __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + from));
+          if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(x, v)) != -1)
+            break;
+        }
+        return FindWordNotEqualScalar(words, from, n, value);
+      }
+#endif
 
-      std::list<int> free_space_;
-      std::list<int> managed_space_;
+      auto SelectKernel(void) -> Kernel {
+#ifdef SIMD_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+          return FindWordNotEqualAvx2;
+        if (__builtin_cpu_supports("sse2"))
+          return FindWordNotEqualSse2;
+#endif
+        return FindWordNotEqualScalar;
+      }
 
-      void Init() {
-        chunk_ = new Tobj * [chunk_popul_];
-        counters_ = new size_t[chunk_popul_];
-        cnt_ctrl_ = new CountControler[chunk_popul_];
-        for (int i = 0; i < chunk_popul_; i++) {
-          free_space_.emplace_back(i);
-          chunk_[i] = nullptr;
-          counters_[i] = 0;
-          cnt_ctrl_[i] = [this, i](int op) {
-            counters_[i] += op;
-          };
-        }
+      /**
+       * @brief Returns the index of the first word in [from, n) that differs from value, or n.
+       */
+      auto FindWordNotEqual(const Word* words, size_t from, size_t n, Word value) -> size_t {
+        static const Kernel kernel = SelectKernel();
+        return kernel(words, from, n, value);
       }
 
-    };
+      auto LowestBit(Word w) -> size_t { return __builtin_ctzll(w); }
+      auto PopCount(Word w) -> size_t { return __builtin_popcountll(w); }
+    } // namespace bitscan
 
-    class MemoryObserver final {
+#ifdef HARDENED
+    /**
+     * @brief Checks of the hardened build. Errors are reported on stderr and abort the process,
+     * unless HARDENED_REPORT_ONLY is defined, in which case the offending operation is skipped.
+     */
+    namespace hardening {
+      constexpr unsigned char kFreePattern = 0xDD;
+      constexpr unsigned char kGuardPattern = 0xFD;
+
+      const void* current_site = nullptr; // Caller of the make_pointer in progress
+
+      void Report(const char* error, const char* type, const void* obj, const void* site = nullptr) {
+        std::cerr << "memman: " << error << " of " << type << " at " << obj;
+        if (site != nullptr)
+          std::cerr << " allocated at " << site;
+        std::cerr << std::endl;
+#ifndef HARDENED_REPORT_ONLY
+        std::abort();
+#endif
+      }
+
+      bool IsFilled(const void* mem, size_t size, unsigned char pattern) {
+        auto bytes = static_cast<const unsigned char*>(mem);
+        for (size_t i = 0; i < size; i++) {
+          if (bytes[i] != pattern)
+            return false;
+        }
+        return true;
+      }
+    } // namespace hardening
+#endif
+
+    /**
+     * @brief Per tenant quotas and accounting. Allocations are charged to the tenant current on
+     * the allocating thread and credited back when a sweep reclaims them.
+     */
+    class TenantLedger final {
     public:
-      using ObserverFunc = std::function<size_t(void)>;
-      using ManagerSweeper = std::function<void(void)>;
-      using Printer = std::function<void(void)>;
+      struct Level {
+        Quota quota;
+        LevelStats stats;
+        bool armed = true; // Sweep when next going past the soft limit
+        std::chrono::steady_clock::time_point next_sweep{};
+      };
     public:
-      static auto Get(void) -> MemoryObserver& {
-        static MemoryObserver singleton;
+      static auto Get(void) -> TenantLedger& {
+        static TenantLedger singleton;
         return singleton;
       }
 
-      void RegisterObserver(const ObserverFunc& f) { observers_.push_back(f); }
-      void RegisterSweeper(const ManagerSweeper& f) { sweepers_.push_back(f); }
-      void RegisterPrint(const Printer& f) { printers_.push_back(f); }
-#ifdef MEM_SIZE
-      bool CanRequestMemory(size_t size) {
-        size_t mem = 0;
-        for (auto& obs : observers_)
-          mem += obs();
-        // std::cout << "\t Memory before Sweep request: " << mem << '\n';
-        SweepIfThreshold(mem >= (threshold_ / 100 * MEM_SIZE));
-        return mem + size > MEM_SIZE ? false : true;
+      // Read on every allocation, so it is kept out of the singleton.
+      static auto Current(void) -> TenantId { return current_; }
+      static void SetCurrent(TenantId tenant) { current_ = tenant; }
+
+      void SetQuota(TenantId tenant, const Quota& quota) {
+        levels_[tenant].quota = { std::min(quota.soft, quota.hard), quota.hard, quota.policy };
+      }
+      auto Find(TenantId tenant) -> Level* {
+        auto iter = levels_.find(tenant);
+        return iter == levels_.end() ? nullptr : &iter->second;
       }
-#endif
 
-      void SweepMemory(void) { SweepIfThreshold(true); }
-      void PrintMemory(void) {
-        std::cout << "Type  |    Address    | Counter | Free | Managed\n";
-        for (auto& printer : printers_)
-          printer();
+      void Charge(TenantId tenant, size_t bytes) {
+        auto& stats = levels_[tenant].stats;
+        stats.bytes += bytes;
+        stats.objects++;
+      }
+      void Credit(TenantId tenant, size_t bytes) {
+        auto& stats = levels_[tenant].stats;
+        stats.bytes -= bytes;
+        stats.objects--;
+      }
+
+      void Collect(MemoryStats& out) const {
+        for (auto& [tenant, level] : levels_) {
+          auto& stats = out.tenants[tenant] = level.stats;
+          stats.soft = level.quota.soft;
+          stats.hard = level.quota.hard;
+        }
       }
 
     private:
-      std::list<ObserverFunc> observers_;
-      std::list<ManagerSweeper> sweepers_;
-      std::list<Printer> printers_;
-      double threshold_ = THRESHOLD;
+      static inline thread_local TenantId current_ = 0;
+      std::unordered_map<TenantId, Level> levels_;
 
-#ifdef MEM_SIZE
-      size_t mem_size_ = MEM_SIZE; // Hard max
-#endif
+      TenantLedger() = default;
+      TenantLedger(const TenantLedger&) = delete;
+      TenantLedger(TenantLedger&&) = delete;
+    };
 
-      void SweepIfThreshold(bool reached) {
-        if (reached) {
-          for (auto& sweeper : sweepers_)
-            sweeper();
-        }
-      }
+#ifdef PERSISTENT_HEAP
+    /**
+     * @brief File a persistent heap lives in: a header page followed by the chunks, each mapped
+     * MAP_SHARED on its own. The header records what the file was built for, so that a mismatching
+     * build, or a file that changed after its last checkpoint and was not closed cleanly, is
+     * rejected instead of remapped.
+     */
+    class PersistentFile final {
+    public:
+      struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+        uint64_t type_hash;
+        uint64_t type_size;
+        uint64_t chunk_size;
+        uint64_t chunk_bytes;
+        uint64_t data_offset;
+        uint64_t chunk_count;
+        uint64_t root;
+        uint64_t checksum;
+        uint64_t clean;
+      };
 
-      MemoryObserver() {
-#ifdef MEM_SIZE
-        // std::cout << "mem_size: " << MEM_SIZE
-        //   << "\nmem_thresh: " << threshold_ / 100
-        //   << std::endl;
+      static constexpr char kMagic[8] = "MEMMAN";
+      static constexpr uint32_t kVersion = 3;
+#ifdef HARDENED
+      static constexpr uint32_t kFlags = 1; // Guard slots change the chunk layout
+#else
+      static constexpr uint32_t kFlags = 0;
 #endif
-      }
-      MemoryObserver(const MemoryObserver&) = delete;
-      MemoryObserver(MemoryObserver&&) = delete;
-      ~MemoryObserver() {
-        observers_.clear();
-      };
-    };
 
-    template <class Tobj>
-    class MemoryManager final {
     public:
-      static auto Get() -> MemoryManager& {
-        static MemoryManager singleton_;
-        return singleton_;
+      PersistentFile(const std::string& path, const Header& expected) {
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0)
+          throw PersistentHeapException("Cannot open persistent heap file");
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+          Fail("Cannot stat persistent heap file");
+        bool fresh = st.st_size == 0;
+        if (fresh && ftruncate(fd_, expected.data_offset) != 0)
+          Fail("Cannot size persistent heap file");
+        if (!fresh && size_t(st.st_size) < sizeof(Header))
+          Fail("Persistent heap file is truncated");
+        header_ = static_cast<Header*>(Map(0, expected.data_offset));
+        if (header_ == nullptr)
+          Fail("Cannot map persistent heap file");
+        if (fresh) {
+          *header_ = expected;
+          return;
+        }
+        if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0)
+          Fail("Not a persistent heap file");
+        if (header_->version != kVersion)
+          Fail("Persistent heap file version mismatch");
+        if (header_->flags != expected.flags || header_->type_hash != expected.type_hash
+          || header_->type_size != expected.type_size || header_->chunk_size != expected.chunk_size
+          || header_->chunk_bytes != expected.chunk_bytes || header_->data_offset != expected.data_offset)
+          Fail("Persistent heap file was built for another type or layout");
+        if (size_t(st.st_size) < ChunkOffset(header_->chunk_count))
+          Fail("Persistent heap file is truncated");
+        if (header_->clean != 1)
+          Fail("Persistent heap file changed after its last sync and was not closed cleanly");
+      }
+      ~PersistentFile() {
+        for (auto& mapping : mappings_)
+          munmap(mapping.first, mapping.second);
+        close(fd_);
       }
 
-      template<typename... Args>
-      auto New(Args&&... args) -> Pointer<Tobj> {
-        Tobj* new_obj = nullptr;
-        MemoryChunk<Tobj>* chunk = nullptr;
-        try {
-          // std::cout << "Finding mem chunk\n";
-          chunk = FindNonFullChunk();
-        }
-        catch (MemoryException& e) {
-          // std::cout << '\t' << e.what() << std::endl;
-#ifdef MEM_SIZE
-          if (MemoryObserver::Get().CanRequestMemory(sizeof(Tobj) * chunk_list_.front().Population())) {
-            // std::cout << "\tCreating new mem chunk\n";
-            chunk_list_.emplace_back();
-          }
-#endif
-          chunk = FindNonFullChunk();
+      auto GetHeader(void) -> Header& { return *header_; }
+      auto ChunkOffset(size_t i) const -> uint64_t { return header_->data_offset + i * header_->chunk_bytes; }
+
+      // Maps chunk i, growing the file when it is a new one.
+      auto MapChunk(size_t i) -> unsigned char* {
+        if (i >= header_->chunk_count) {
+          if (ftruncate(fd_, ChunkOffset(i + 1)) != 0)
+            throw PersistentHeapException("Cannot grow persistent heap file");
+          header_->chunk_count = i + 1;
         }
-        assert(chunk != nullptr);
-        auto iter = chunk->Allocate(std::forward<Args>(args)...);
+        void* mem = Map(ChunkOffset(i), header_->chunk_bytes);
+        if (mem == nullptr)
+          throw PersistentHeapException("Cannot map persistent heap file");
+        return static_cast<unsigned char*>(mem);
+      }
 
-        new_obj = iter.GetPointer();
-        Pointer<Tobj> ret(iter.GetPointer());
-        ret.cnt_ctrlr_ = iter.GetCntCtrl();
-        return ret;
+      void MarkDirty(void) {
+        header_->clean = 0;
+        Sync();
+      }
+      void MarkClean(uint64_t checksum) {
+        header_->checksum = checksum;
+        header_->clean = 1;
+        Sync();
+      }
+      void Sync(void) {
+        for (auto& mapping : mappings_)
+          msync(mapping.first, mapping.second, MS_SYNC);
       }
 
     private:
-      std::list<MemoryChunk<Tobj>> chunk_list_;
+      int fd_ = -1;
+      Header* header_ = nullptr;
+      std::vector<std::pair<void*, size_t>> mappings_;
 
-      auto FindNonFullChunk(void) -> MemoryChunk<Tobj>* {
-        for (auto& chunk : chunk_list_) {
-          if (!chunk.IsFull())
-            return &chunk;
-        }
-        throw UnavailableChunksException();
+      // Returns nullptr on failure, so that the constructor can clean up through Fail.
+      auto Map(uint64_t offset, size_t bytes) -> void* {
+        void* mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, offset);
+        if (mem == MAP_FAILED)
+          return nullptr;
+        mappings_.emplace_back(mem, bytes);
+        return mem;
       }
 
-      MemoryManager() {
-        chunk_list_.emplace_back();
-        MemoryObserver::Get().RegisterObserver(
-          [this]() {
-            return CHUNK_SIZE * chunk_list_.size();
-          }
-        );
-        MemoryObserver::Get().RegisterSweeper(
-          [this]() {
-            for (auto& chunk : chunk_list_)
-              chunk.SweepManagedMem();
-          }
-        );
-        MemoryObserver::Get().RegisterPrint(
-          [this]() {
-            for (auto& chunk : chunk_list_)
-              std::cout << chunk << "\n-------------------------------\n";
-          }
-        );
-      }
-      MemoryManager(const MemoryManager&) = delete;
-      MemoryManager(MemoryManager&&) = delete;
-      ~MemoryManager() {
-        chunk_list_.clear();
+      [[noreturn]] void Fail(const char* reason) {
+        for (auto& mapping : mappings_)
+          munmap(mapping.first, mapping.second);
+        mappings_.clear();
+        close(fd_);
+        throw PersistentHeapException(reason);
       }
     };
 
-  } // namespace
+#endif
 
-  template <typename Tobj>
-  class Pointer {
-  public:
-    Pointer(Tobj* obj = nullptr) : ptr_(obj) {}
-    Pointer(const Pointer& _obj) {
-      ptr_ = _obj.ptr_;
-      _obj.cnt_ctrlr_(1);
-      cnt_ctrlr_ = _obj.cnt_ctrlr_;
-    }
-    Pointer(Pointer&& _obj) {
-      ptr_ = _obj.ptr_;
-      _obj.cnt_ctrlr_(1);
-      cnt_ctrlr_ = _obj.cnt_ctrlr_;
-    }
-    ~Pointer() {
-      cnt_ctrlr_(-1);
+#if defined(PERSISTENT_HEAP) || defined(SHARED_POOL)
+    auto Fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) -> uint64_t {
+      auto bytes = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+      return hash;
     }
+#endif
 
-    auto Get() const -> Tobj& { return *ptr_; }
-    auto Get() -> Tobj& { return *ptr_; }
-
-    auto operator*(void) -> Tobj& { return *ptr_; }
-    auto operator*(void) const -> Tobj& { return *ptr_; }
-    auto operator->(void) -> Tobj& { return *ptr_; }
-    auto operator->(void) const -> Tobj& { return *ptr_; }
+    /**
+     * @brief Storage for a single object of a chunk. Objects small enough to share a cache line
+     * with their reference count carry it in the slot header, larger ones keep their counts
+     * in a separate, densely packed array. Counts are 32 bits so that small objects pay
+     * as little as possible for theirs.
+     */
+    template<class Tobj, bool = (sizeof(Tobj) <= 16)>
+    struct Slot {
+      alignas(Tobj) unsigned char obj[sizeof(Tobj)];
+    };
+
+    template<class Tobj>
+    struct Slot<Tobj, true> {
+      uint32_t count;
+      alignas(Tobj) unsigned char obj[sizeof(Tobj)];
+    };
+
+    template<class Tobj>
+    class MemoryChunk final {
+    public:
+      using Counter = uint32_t;
+      using Word = bitscan::Word;
+      class Iterator;
+
+      static constexpr bool kTrivialDtor = std::is_trivially_destructible<Tobj>::value;
+      static constexpr bool kPackedCount = sizeof(Tobj) <= 16;
+#ifdef HARDENED
+      static constexpr size_t kGuardSlots = 2;
+      static constexpr size_t kDebugBytes = sizeof(uint32_t) + sizeof(void*); // Generation and allocation site
+#else
+      static constexpr size_t kGuardSlots = 0;
+      static constexpr size_t kDebugBytes = 0;
+#endif
+      static constexpr size_t kPopul = CHUNK_SIZE / sizeof(Slot<Tobj>);
+      static constexpr size_t kWords = (kPopul + bitscan::kWordBits - 1) / bitscan::kWordBits;
+#ifdef HEAP_PROFILE
+      static constexpr size_t kBitmaps = 3;
+#else
+      static constexpr size_t kBitmaps = 2;
+#endif
+      // Memory a chunk takes on the heap: slots, separate counts, bitmaps and debug state.
+      static constexpr size_t kBytes = (kPopul + kGuardSlots) * sizeof(Slot<Tobj>) + (kPackedCount ? 0 : kPopul * sizeof(Counter))
+        + kBitmaps * kWords * sizeof(Word) + kPopul * kDebugBytes;
+
+    public:
+      MemoryChunk() {
+        Init();
+      }
+#ifdef PERSISTENT_HEAP
+      /**
+       * @brief Where the parts of a chunk live inside its region of a persistent heap file.
+       */
+      struct MappedLayout {
+        static constexpr auto AlignUp(size_t n, size_t align) -> size_t { return (n + align - 1) / align * align; }
+
+        static constexpr size_t kOccupied = 0;
+        static constexpr size_t kReleased = kOccupied + kWords * sizeof(Word);
+        static constexpr size_t kPins = kReleased + kWords * sizeof(Word);
+        static constexpr size_t kCounters = AlignUp(kPins + kPopul * sizeof(uint32_t), alignof(Counter));
+        static constexpr size_t kSlots = AlignUp(kCounters + (kPackedCount ? 0 : kPopul * sizeof(Counter)), alignof(Slot<Tobj>));
+        static constexpr size_t kBytes = kSlots + (kPopul + kGuardSlots) * sizeof(Slot<Tobj>);
+      };
+
+      /**
+       * @brief Builds a chunk inside a region of a persistent heap file.
+       *
+       * @param region Start of the chunk's mapping, MappedLayout::kBytes long.
+       * @param offset Offset of the region in the heap file.
+       * @param clean Clean flag of the heap file, cleared by every change to the bookkeeping.
+       * @param restore Whether the region holds a chunk of a previous run.
+       */
+      MemoryChunk(unsigned char* region, uint64_t offset, uint64_t* clean, bool restore) : region_(region), offset_(offset), clean_(clean) {
+        occupied_ = reinterpret_cast<Word*>(region + MappedLayout::kOccupied);
+        released_ = reinterpret_cast<Word*>(region + MappedLayout::kReleased);
+        pins_ = reinterpret_cast<uint32_t*>(region + MappedLayout::kPins);
+        if constexpr (!kPackedCount)
+          counters_ = reinterpret_cast<Counter*>(region + MappedLayout::kCounters);
+        slots_ = reinterpret_cast<Slot<Tobj>*>(region + MappedLayout::kSlots) + kGuardSlots / 2;
+        if (restore)
+          Restore();
+        else
+          InitMapped();
+      }
+
+      /**
+       * @brief Hashes the bookkeeping of a chunk region, to check it on the next restart. Released
+       * bits are left out: they change as Pointers go away and are rebuilt on restart anyway.
+       */
+      static auto Checksum(const unsigned char* region, uint64_t hash) -> uint64_t {
+        hash = Fnv1a(region + MappedLayout::kOccupied, MappedLayout::kReleased - MappedLayout::kOccupied, hash);
+        return Fnv1a(region + MappedLayout::kPins, MappedLayout::kCounters - MappedLayout::kPins, hash);
+      }
+      auto Checksum(uint64_t hash) const -> uint64_t { return Checksum(region_, hash); }
+#endif
+      ~MemoryChunk() {
+#ifdef HARDENED
+        CheckGuards();
+        ForEachBit(occupied_, [this](size_t i) {
+          if (Count(i) != 0)
+            std::cerr << "memman: leaked " << typeid(Tobj).name() << " at " << Object(i)
+            << " (count " << Count(i) << ") allocated at " << sites_[i] << std::endl;
+          });
+#endif
+#ifdef HEAP_PROFILE
+        delete[] sampled_;
+#endif
+        delete[] tenants_;
+#ifdef PERSISTENT_HEAP
+        if (region_ != nullptr) { // Objects stay in the file for the next run
+          UNPOISON_MEMORY(region_, MappedLayout::kBytes);
+#ifdef HARDENED
+          delete[] generations_;
+          delete[] sites_;
+#endif
+          return;
+        }
+#endif
+        if constexpr (!kTrivialDtor)
+          ForEachBit(occupied_, [this](size_t i) { Object(i)->~Tobj(); });
+        UNPOISON_MEMORY(slots_ - kGuardSlots / 2, sizeof(Slot<Tobj>) * (chunk_popul_ + kGuardSlots));
+        delete[] (slots_ - kGuardSlots / 2);
+#ifdef HARDENED
+        delete[] generations_;
+        delete[] sites_;
+#endif
+        delete[] counters_;
+        delete[] occupied_;
+        delete[] released_;
+      }
+
+      template<typename... Args>
+      auto Allocate(TenantId tenant, Args&&... args) -> Iterator {
+        size_t word = search_hint_;
+        if (occupied_[word] == ~Word(0))
+          word = bitscan::FindWordNotEqual(occupied_, word + 1, words_, ~Word(0));
+        assert(word < words_);
+        Word mask = ~occupied_[word] & (occupied_[word] + 1); // lowest clear bit
+        size_t index = word * bitscan::kWordBits + bitscan::LowestBit(mask);
+        UNPOISON_MEMORY(Object(index), sizeof(Tobj));
+#ifdef HARDENED
+        if (!hardening::IsFilled(Object(index), sizeof(Tobj), hardening::kFreePattern))
+          hardening::Report("write after free", typeid(Tobj).name(), Object(index), sites_[index]);
+#endif
+        Tobj* obj = new (Object(index)) Tobj(std::forward<Args>(args)...);
+        occupied_[word] |= mask;
+        search_hint_ = word;
+        Count(index) = 1;
+        managed_++;
+#ifdef HEAP_PROFILE
+        if (HeapProfiler::ShouldSample(sizeof(Tobj))) {
+          sampled_[word] |= mask;
+          HeapProfiler::Get().RecordAllocation(obj, sizeof(Tobj));
+        }
+#endif
+#ifdef HARDENED
+        sites_[index] = hardening::current_site;
+#endif
+#ifdef PERSISTENT_HEAP
+        if (pins_ != nullptr) {
+          pins_[index] = 0;
+          *clean_ = 0;
+        }
+#endif
+        if (__builtin_expect(tenant != 0 || tenants_ != nullptr, 0))
+          RecordTenant(index, tenant);
+
+        return Iterator(obj, MakeRef(index));
+      }
+
+#ifdef PERSISTENT_HEAP
+      /**
+       * @brief Hands out another reference to the object at the given offset of the heap file.
+       *
+       * @throws PersistentHeapException if no live object is there.
+       */
+      auto Acquire(uint64_t offset) -> Iterator {
+        size_t index = IndexOf(offset);
+        Count(index)++;
+        return Iterator(Object(index), MakeRef(index));
+      }
+
+      void Unpin(uint64_t offset) {
+        size_t index = IndexOf(offset);
+        if (pins_[index] == 0)
+          throw PersistentHeapException("Handle is not pinned");
+        *clean_ = 0;
+        if (--pins_[index] == 0 && Count(index) == 0)
+          released_[index / bitscan::kWordBits] |= Word(1) << (index % bitscan::kWordBits);
+      }
+#endif
+
+      void SweepManagedMem(void) {
+        size_t word = bitscan::FindWordNotEqual(released_, 0, words_, 0);
+        if (word < search_hint_)
+          search_hint_ = word;
+        for (; word < words_; word = bitscan::FindWordNotEqual(released_, word + 1, words_, 0)) {
+          Reclaim(word, released_[word]);
+          released_[word] = 0;
+        }
+#ifdef HARDENED
+        CheckGuards();
+#endif
+#ifdef CHECK_INVARIANTS
+        CheckInvariants();
+#endif
+      }
+
+      /**
+       * @brief Reclaims only the released objects allocated by a tenant, leaving the others for the
+       * next full sweep.
+       */
+      void SweepTenant(TenantId tenant) {
+        if (tenants_ == nullptr)
+          return;
+        for (size_t word = bitscan::FindWordNotEqual(released_, 0, words_, 0); word < words_;
+          word = bitscan::FindWordNotEqual(released_, word + 1, words_, 0)) {
+          Word dead = 0;
+          for (Word w = released_[word]; w != 0; w &= w - 1) {
+            size_t bit = bitscan::LowestBit(w);
+            if (tenants_[word * bitscan::kWordBits + bit] == tenant)
+              dead |= Word(1) << bit;
+          }
+          if (dead == 0)
+            continue;
+          Reclaim(word, dead);
+          released_[word] &= ~dead;
+          if (word < search_hint_)
+            search_hint_ = word;
+        }
+      }
+
+      bool IsFull(void) { return managed_ == chunk_popul_; }
+      bool IsEmpty(void) { return managed_ == 0; }
+      auto Size(void) -> size_t { return managed_; }
+      auto Population(void) -> size_t { return chunk_popul_; }
+      // Heap taken by the tenant records, made on the first tenant allocation.
+      auto TenantBytes(void) const -> size_t { return tenants_ == nullptr ? 0 : chunk_popul_ * sizeof(TenantId); }
+
+      class Iterator {
+      public:
+        Iterator(Tobj* _obj, const detail::SlotRef& _ref) : obj_(_obj), ref_(_ref) {}
+        ~Iterator() = default;
+
+        auto GetPointer(void) const -> Tobj* { return obj_; }
+        auto GetCount(void) const -> size_t { return *ref_.count; }
+        auto GetSlotRef(void) const -> const detail::SlotRef& { return ref_; }
+
+      private:
+        Tobj* obj_;
+        detail::SlotRef ref_;
+      };
+
+      friend auto operator<<(std::ostream& os, const MemoryChunk& ch) -> std::ostream& {
+        for (size_t i = 0; i < ch.chunk_popul_; i++) {
+          bool free = !ch.IsOccupied(i);
+          os << typeid(Tobj*).name() << "   " << (free ? nullptr : ch.Object(i)) << "   " << (free ? 0 : ch.Count(i)) << "   " << free << "   " << !free << '\n';
+        }
+        return os;
+      }
+
+    private:
+      size_t chunk_popul_ = kPopul;
+      size_t words_ = kWords;
+      Slot<Tobj>* slots_ = nullptr;
+      Counter* counters_ = nullptr;
+      Word* occupied_ = nullptr; // Bit set: slot holds a managed object
+      Word* released_ = nullptr; // Bit set: managed object whose count dropped to zero
+      TenantId* tenants_ = nullptr; // Tenant each object is charged to, made on the first tenant allocation
+#ifdef HEAP_PROFILE
+      Word* sampled_ = nullptr;  // Bit set: object tracked by the heap profiler
+#endif
+#ifdef HARDENED
+      uint32_t* generations_ = nullptr;
+      const void** sites_ = nullptr;
+#endif
+#ifdef PERSISTENT_HEAP
+      uint32_t* pins_ = nullptr;         // Handle references, part of the heap file
+      unsigned char* region_ = nullptr;  // Heap file mapping the chunk lives in, if any
+      uint64_t offset_ = 0;
+      uint64_t* clean_ = nullptr;
+#endif
+      size_t search_hint_ = 0;   // No free slot lives in a word before this one
+      size_t managed_ = 0;
+
+      // Destroys the released objects of a word given by dead and frees their slots, leaving their
+      // released bits to the caller.
+      void Reclaim(size_t word, Word dead) {
+        for (Word w = dead; w != 0; w &= w - 1) {
+          size_t i = word * bitscan::kWordBits + bitscan::LowestBit(w);
+          if constexpr (!kTrivialDtor)
+            Object(i)->~Tobj();
+#ifdef HARDENED
+          generations_[i]++;
+          std::memset(slots_[i].obj, hardening::kFreePattern, sizeof(Tobj));
+#endif
+          POISON_MEMORY(Object(i), sizeof(Tobj));
+        }
+        if (tenants_ != nullptr) {
+          for (Word w = dead; w != 0; w &= w - 1) {
+            size_t i = word * bitscan::kWordBits + bitscan::LowestBit(w);
+            if (tenants_[i] != 0)
+              TenantLedger::Get().Credit(tenants_[i], sizeof(Tobj));
+          }
+        }
+#ifdef HEAP_PROFILE
+        for (Word w = dead & sampled_[word]; w != 0; w &= w - 1)
+          HeapProfiler::Get().RecordFree(Object(word * bitscan::kWordBits + bitscan::LowestBit(w)));
+        sampled_[word] &= ~dead;
+#endif
+        occupied_[word] &= ~dead;
+        managed_ -= bitscan::PopCount(dead);
+#ifdef PERSISTENT_HEAP
+        if (clean_ != nullptr)
+          *clean_ = 0;
+#endif
+      }
+
+      // Kept out of Allocate so that allocations without tenants stay small enough to inline.
+      __attribute__((noinline)) void RecordTenant(size_t index, TenantId tenant) {
+        if (tenants_ == nullptr)
+          tenants_ = new TenantId[chunk_popul_]();
+        tenants_[index] = tenant;
+        if (tenant != 0)
+          TenantLedger::Get().Charge(tenant, sizeof(Tobj));
+      }
+
+      auto MakeRef(size_t index) -> detail::SlotRef {
+        detail::SlotRef ref;
+        ref.count = &Count(index);
+        ref.released = &released_[index / bitscan::kWordBits];
+        ref.released_mask = Word(1) << (index % bitscan::kWordBits);
+#ifdef HARDENED
+        ref.generation = &generations_[index];
+        ref.tag = generations_[index];
+#endif
+#ifdef PERSISTENT_HEAP
+        if (pins_ != nullptr) {
+          ref.pins = &pins_[index];
+          ref.offset = offset_ + (reinterpret_cast<unsigned char*>(Object(index)) - region_);
+        }
+#endif
+        return ref;
+      }
+
+      auto Object(size_t i) const -> Tobj* { return reinterpret_cast<Tobj*>(slots_[i].obj); }
+      auto Count(size_t i) -> Counter& {
+        if constexpr (kPackedCount)
+          return slots_[i].count;
+        else
+          return counters_[i];
+      }
+      auto Count(size_t i) const -> const Counter& { return const_cast<MemoryChunk*>(this)->Count(i); }
+      bool IsOccupied(size_t i) const { return occupied_[i / bitscan::kWordBits] >> (i % bitscan::kWordBits) & 1; }
+
+      template<typename F>
+      void ForEachBit(const Word* bits, F f) const {
+        for (size_t word = 0; word < words_; word++) {
+          for (Word w = bits[word]; w != 0; w &= w - 1) {
+            size_t i = word * bitscan::kWordBits + bitscan::LowestBit(w);
+            if (i < chunk_popul_)
+              f(i);
+          }
+        }
+      }
+
+#ifdef HARDENED
+      // The slots right before and after the chunk are guards, filled with a pattern that
+      // only an overflowing write can change.
+      void CheckGuards(void) {
+        for (Slot<Tobj>* guard : { slots_ - 1, slots_ + chunk_popul_ }) {
+          UNPOISON_MEMORY(guard, sizeof(Slot<Tobj>));
+          if (!hardening::IsFilled(guard, sizeof(Slot<Tobj>), hardening::kGuardPattern))
+            hardening::Report("overflow into guard slot", typeid(Tobj).name(), guard);
+          POISON_MEMORY(guard, sizeof(Slot<Tobj>));
+        }
+      }
+#endif
+
+#ifdef CHECK_INVARIANTS
+      // After a sweep nothing is left released, the bitmaps agree with the object count, the bits
+      // past the population stay occupied and every word before the search hint is full.
+      void CheckInvariants(void) const {
+        size_t occupied = 0;
+        for (size_t word = 0; word < words_; word++) {
+          if (released_[word] != 0)
+            throw InvariantException("Released object survived a sweep");
+          if (word < search_hint_ && occupied_[word] != ~Word(0))
+            throw InvariantException("Free slot before the search hint");
+          occupied += bitscan::PopCount(occupied_[word]);
+        }
+        Word tail = chunk_popul_ % bitscan::kWordBits ? ~Word(0) << (chunk_popul_ % bitscan::kWordBits) : 0;
+        if ((occupied_[words_ - 1] & tail) != tail)
+          throw InvariantException("Slot past the population marked free");
+        if (occupied - bitscan::PopCount(tail) != managed_)
+          throw InvariantException("Object count disagrees with the occupied bitmap");
+        ForEachBit(occupied_, [this](size_t i) {
+          bool pinned = false;
+#ifdef PERSISTENT_HEAP
+          pinned = pins_ != nullptr && pins_[i] != 0;
+#endif
+          if (Count(i) == 0 && !pinned)
+            throw InvariantException("Unreferenced object was never released");
+          });
+      }
+#endif
+
+      // Slots and counters are left uninitialized, they are written on first hand out.
+      void Init() {
+        slots_ = new Slot<Tobj>[chunk_popul_ + kGuardSlots] + kGuardSlots / 2;
+        if constexpr (!kPackedCount)
+          counters_ = new Counter[chunk_popul_];
+        occupied_ = new Word[words_]();
+        released_ = new Word[words_]();
+        InitSlots();
+        InitDebugState();
+      }
+
+      // Bits past the population are marked occupied so they are never handed out.
+      void InitSlots(void) {
+#ifdef HARDENED
+        std::memset(slots_ - 1, hardening::kGuardPattern, sizeof(Slot<Tobj>));
+        std::memset(slots_ + chunk_popul_, hardening::kGuardPattern, sizeof(Slot<Tobj>));
+#endif
+        for (size_t i = 0; i < chunk_popul_; i++) {
+#ifdef HARDENED
+          std::memset(slots_[i].obj, hardening::kFreePattern, sizeof(Tobj));
+#endif
+          POISON_MEMORY(Object(i), sizeof(Tobj));
+        }
+        if (size_t tail = chunk_popul_ % bitscan::kWordBits)
+          occupied_[words_ - 1] = ~Word(0) << tail;
+      }
+
+      void InitDebugState(void) {
+#ifdef HARDENED
+        POISON_MEMORY(slots_ - 1, sizeof(Slot<Tobj>));
+        POISON_MEMORY(slots_ + chunk_popul_, sizeof(Slot<Tobj>));
+        generations_ = new uint32_t[chunk_popul_]();
+        sites_ = new const void* [chunk_popul_]();
+#endif
+#ifdef HEAP_PROFILE
+        sampled_ = new Word[words_]();
+#endif
+      }
+
+#ifdef PERSISTENT_HEAP
+      void InitMapped(void) {
+        std::memset(region_, 0, MappedLayout::kCounters);
+        InitSlots();
+        InitDebugState();
+      }
+
+      // References of the previous run are gone: objects it only held through Pointers are
+      // released, pinned ones wait for new Pointers.
+      void Restore(void) {
+        ForEachBit(occupied_, [this](size_t i) {
+          Count(i) = 0;
+          if (pins_[i] == 0)
+            released_[i / bitscan::kWordBits] |= Word(1) << (i % bitscan::kWordBits);
+          managed_++;
+          });
+        for (size_t i = 0; i < chunk_popul_; i++) {
+          if (!IsOccupied(i))
+            POISON_MEMORY(Object(i), sizeof(Tobj));
+        }
+        InitDebugState();
+      }
+
+      auto IndexOf(uint64_t offset) -> size_t {
+        size_t rel = offset - offset_ - (reinterpret_cast<unsigned char*>(Object(0)) - region_);
+        size_t index = rel / sizeof(Slot<Tobj>);
+        if (offset < offset_ || rel % sizeof(Slot<Tobj>) != 0 || index >= chunk_popul_ || !IsOccupied(index)
+          || (Count(index) == 0 && pins_[index] == 0))
+          throw PersistentHeapException("Handle does not refer to a live object");
+        return index;
+      }
+#endif
+
+    };
+
+    class MemoryObserver final {
+    public:
+      using ObserverFunc = std::function<size_t(void)>;
+      using ManagerSweeper = std::function<void(void)>;
+      using TenantSweeper = std::function<void(TenantId)>;
+      using Printer = std::function<void(void)>;
+      using PressureCallback = std::function<void(PressureLevel)>;
+      using SpaceCheck = std::function<bool(void)>;
+      using StatsCollector = std::function<void(MemoryStats&)>;
+      using Clock = std::chrono::steady_clock;
+
+      static constexpr size_t kUnlimited = ~size_t(0);
+    public:
+      static auto Get(void) -> MemoryObserver& {
+        static MemoryObserver singleton;
+        return singleton;
+      }
+
+      void RegisterObserver(const ObserverFunc& f) { observers_.push_back(f); }
+      void RegisterSweeper(const ManagerSweeper& f) { sweepers_.push_back(f); }
+      void RegisterTenantSweeper(const TenantSweeper& f) { tenant_sweepers_.push_back(f); }
+      void RegisterPrint(const Printer& f) { printers_.push_back(f); }
+      void RegisterStats(const StatsCollector& f) { collectors_.push_back(f); }
+
+      auto RegisterPressureCallback(const PressureCallback& f) -> size_t {
+        callbacks_.emplace_back(next_callback_id_, f);
+        return next_callback_id_++;
+      }
+      void UnregisterPressureCallback(size_t id) {
+        callbacks_.remove_if([id](const auto& cb) { return cb.first == id; });
+      }
+
+      void SetLimits(size_t soft, size_t hard) {
+        soft_limit_ = std::min(soft, hard);
+        hard_limit_ = hard;
+      }
+      void SetReserve(size_t bytes) { reserve_ = bytes; }
+      void FollowCgroupLimit(bool follow) { follow_cgroup_ = follow; }
+      void SetAllocationMode(AllocationMode mode, std::chrono::milliseconds timeout) {
+        mode_ = mode;
+        timeout_ = timeout;
+      }
+
+      /**
+       * @brief Decides how a manager whose chunks are all full gets room for size more bytes.
+       * Past the soft limit pressure callbacks run and memory is swept before growing, at the hard
+       * limit blocking mode keeps doing so until its timeout, then the emergency reserve is used.
+       * No other thread can free managed memory meanwhile, so blocking only helps when the
+       * callbacks drop references on a later try.
+       *
+       * @param size Bytes the manager would grow by.
+       * @param has_space Tells whether the manager's existing chunks have room again.
+       * @return true if the manager may grow, false if room was freed in its chunks.
+       * @throws MemoryLimitException when no room could be found.
+       */
+      bool RequestMemory(size_t size, const SpaceCheck& has_space) {
+        bool blocking = mode_ == AllocationMode::Blocking && nonblocking_depth_ == 0;
+        auto deadline = Clock::now() + timeout_;
+        size_t mem = UsedMemory();
+        size_t hard = HardLimit();
+        if (Fits(mem, size, SoftLimit(hard)))
+          return true;
+        if (Relieve(PressureLevel::Soft, has_space))
+          return false;
+        if (Fits(mem, size, hard))
+          return true;
+        do {
+          if (Relieve(PressureLevel::Hard, has_space))
+            return false;
+          if (blocking && Clock::now() < deadline)
+            std::this_thread::sleep_for(retry_interval_);
+        } while (blocking && Clock::now() < deadline);
+        if (hard != kUnlimited && Fits(mem, size, hard + reserve_)) {
+          Notify(PressureLevel::Critical);
+          return true;
+        }
+        denials_++;
+        throw MemoryLimitException();
+      }
+
+      /**
+       * @brief Applies the quota of a tenant, if it has one, to an allocation of size bytes.
+       * The tenant is swept when it first goes past its soft limit, again only once it has come
+       * back under it, and whenever it would go past its hard limit. A sweep that leaves the tenant
+       * past its soft limit holds off the next one for tenant_sweep_interval_, so that a tenant
+       * living past its soft limit does not sweep on every allocation; at the hard limit blocking
+       * mode waits for the interval to pass.
+       *
+       * @throws MemoryLimitException when the allocation would take the tenant past its hard limit.
+       */
+      void RequestTenantMemory(TenantId tenant, size_t size) {
+        auto* level = TenantLedger::Get().Find(tenant);
+        if (level == nullptr)
+          return;
+        if (Fits(level->stats.bytes, size, level->quota.soft)) {
+          level->armed = true;
+          return;
+        }
+        bool at_hard = !Fits(level->stats.bytes, size, level->quota.hard);
+        if ((level->armed || at_hard) && level->quota.policy != SweepPolicy::None) {
+          auto now = Clock::now();
+          if (at_hard && now < level->next_sweep && mode_ == AllocationMode::Blocking && nonblocking_depth_ == 0) {
+            std::this_thread::sleep_until(level->next_sweep);
+            now = Clock::now();
+          }
+          if (now >= level->next_sweep) {
+            level->stats.sweeps++;
+            if (level->quota.policy == SweepPolicy::Own) {
+              for (auto& sweeper : tenant_sweepers_)
+                sweeper(tenant);
+            }
+            else {
+              SweepIfThreshold(true);
+            }
+            level->armed = Fits(level->stats.bytes, size, level->quota.soft);
+            if (!level->armed)
+              level->next_sweep = now + tenant_sweep_interval_;
+          }
+        }
+        if (!Fits(level->stats.bytes, size, level->quota.hard)) {
+          level->stats.denials++;
+          throw MemoryLimitException();
+        }
+      }
+
+      void SweepMemory(void) { SweepIfThreshold(true); }
+
+      auto Stats(void) -> MemoryStats {
+        MemoryStats stats;
+        for (auto& collect : collectors_)
+          collect(stats);
+        TenantLedger::Get().Collect(stats);
+        stats.global.bytes = UsedMemory();
+        for (auto& type : stats.types)
+          stats.global.objects += type.second.objects;
+        stats.global.hard = HardLimit();
+        stats.global.soft = SoftLimit(stats.global.hard);
+        stats.global.sweeps = sweeps_;
+        stats.global.denials = denials_;
+        return stats;
+      }
+
+      /**
+       * @brief Makes the requests made in its lifetime fail instead of blocking, for callers
+       * that have a better way to wait.
+       */
+      class NonBlockingScope {
+      public:
+        NonBlockingScope() { MemoryObserver::Get().nonblocking_depth_++; }
+        ~NonBlockingScope() { MemoryObserver::Get().nonblocking_depth_--; }
+      };
+
+      /**
+       * @brief Marks an allocation or sweep in progress, where user code may run and allocate:
+       * waiters are only retried outside of one.
+       */
+      class AllocationScope {
+      public:
+        AllocationScope() { depth_++; }
+        ~AllocationScope() { depth_--; }
+      };
+
+      /**
+       * @brief Queues an allocation that failed under pressure. The retry returns true once it
+       * succeeded, and is tried again once a sweep reclaimed memory, outside of any allocation.
+       *
+       * @return Id to unregister the waiter with, should it go away before succeeding.
+       */
+      auto RegisterWaiter(const SpaceCheck& retry) -> size_t {
+        waiters_.emplace_back(next_waiter_id_, retry);
+        return next_waiter_id_++;
+      }
+      void UnregisterWaiter(size_t id) {
+        waiters_.remove_if([id](const auto& waiter) { return waiter.first == id; });
+      }
+      auto WaiterCount(void) -> size_t { return waiters_.size(); }
+
+      void MarkReclaimed(void) {
+        if (!waiters_.empty())
+          waiters_ready_ = true;
+      }
+      static bool InAllocation(void) { return depth_ != 0; }
+      void PollWaiters(void) {
+        if (waiters_ready_ && depth_ == 0)
+          ResumeWaiters();
+      }
+
+      // Oldest first. A retry may resume code that unregisters or adds waiters, so each one is
+      // looked up again by id and run from a copy, and the ones added meanwhile wait for next time.
+      // The allocations of resumed coroutines are nested in this one, so they do not retry again.
+      void ResumeWaiters(void) {
+        AllocationScope scope;
+        waiters_ready_ = false;
+        std::vector<size_t> ids;
+        for (auto& waiter : waiters_)
+          ids.push_back(waiter.first);
+        for (size_t id : ids) {
+          auto iter = std::find_if(waiters_.begin(), waiters_.end(), [id](const auto& waiter) { return waiter.first == id; });
+          if (iter == waiters_.end())
+            continue;
+          SpaceCheck retry = iter->second;
+          if (retry())
+            UnregisterWaiter(id);
+        }
+      }
+      void PrintMemory(void) {
+        std::cout << "Type  |    Address    | Counter | Free | Managed\n";
+        for (auto& printer : printers_)
+          printer();
+      }
+
+    private:
+      std::list<ObserverFunc> observers_;
+      std::list<ManagerSweeper> sweepers_;
+      std::list<TenantSweeper> tenant_sweepers_;
+      std::list<Printer> printers_;
+      std::list<StatsCollector> collectors_;
+      std::list<std::pair<size_t, PressureCallback>> callbacks_;
+      size_t next_callback_id_ = 0;
+      double threshold_ = THRESHOLD;
+
+#ifdef MEM_SIZE
+      size_t hard_limit_ = MEM_SIZE;
+      size_t soft_limit_ = threshold_ / 100 * MEM_SIZE;
+#else
+      size_t hard_limit_ = kUnlimited;
+      size_t soft_limit_ = kUnlimited;
+#endif
+      size_t reserve_ = RESERVE_CHUNKS * CHUNK_SIZE;
+#ifdef CGROUP_MEM_LIMIT
+      bool follow_cgroup_ = true;
+#else
+      bool follow_cgroup_ = false;
+#endif
+      AllocationMode mode_ = AllocationMode::NonBlocking;
+      std::chrono::milliseconds timeout_{ 0 };
+      std::chrono::milliseconds retry_interval_{ 1 };
+      std::chrono::milliseconds tenant_sweep_interval_{ 1 };
+      size_t nonblocking_depth_ = 0;
+      std::list<std::pair<size_t, SpaceCheck>> waiters_;
+      size_t next_waiter_id_ = 0;
+      static inline size_t depth_ = 0;          // Allocations and sweeps in progress, nested ones included
+      static inline bool waiters_ready_ = false; // A sweep reclaimed memory since waiters were last retried
+      size_t sweeps_ = 0;  // Sweeps run under pressure of the global limits
+      size_t denials_ = 0;
+
+      void SweepIfThreshold(bool reached) {
+        if (reached) {
+          for (auto& sweeper : sweepers_)
+            sweeper();
+        }
+      }
+
+      auto UsedMemory(void) -> size_t {
+        size_t mem = 0;
+        for (auto& obs : observers_)
+          mem += obs();
+        return mem;
+      }
+
+      static bool Fits(size_t mem, size_t size, size_t limit) { return limit == kUnlimited || mem + size <= limit; }
+
+      auto HardLimit(void) -> size_t { return follow_cgroup_ ? std::min(hard_limit_, CgroupHardLimit()) : hard_limit_; }
+      auto SoftLimit(size_t hard) -> size_t { return hard == hard_limit_ ? soft_limit_ : std::min(soft_limit_, size_t(threshold_ / 100 * hard)); }
+
+      void Notify(PressureLevel level) {
+        for (auto& cb : callbacks_)
+          cb.second(level);
+      }
+
+      bool Relieve(PressureLevel level, const SpaceCheck& has_space) {
+        Notify(level);
+        sweeps_++;
+        SweepIfThreshold(true);
+        return has_space();
+      }
+
+      // The rest of the process counts against memory.max too, and the reserve goes past the hard
+      // limit, so both are kept below the cgroup limit.
+      auto CgroupHardLimit(void) -> size_t {
+        size_t limit = ReadCgroupLimit();
+        if (limit == kUnlimited)
+          return kUnlimited;
+        size_t share = limit / 100 * CGROUP_MEM_SHARE;
+        return share > reserve_ ? share - reserve_ : 0;
+      }
+
+      // cgroup v2 exposes memory.max ("max" when unlimited), v1 memory.limit_in_bytes.
+      static auto ReadCgroupLimit(void) -> size_t {
+        for (const char* path : { "/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes" }) {
+          std::ifstream file(path);
+          std::string value;
+          if (file >> value) {
+            if (value == "max")
+              return kUnlimited;
+            try {
+              return std::stoull(value);
+            }
+            catch (std::exception&) {
+              return kUnlimited;
+            }
+          }
+        }
+        return kUnlimited;
+      }
+
+      MemoryObserver() = default;
+      MemoryObserver(const MemoryObserver&) = delete;
+      MemoryObserver(MemoryObserver&&) = delete;
+      ~MemoryObserver() {
+        observers_.clear();
+      };
+    };
+
+    template <class Tobj>
+    class MemoryManager final {
+    public:
+      static auto Get() -> MemoryManager& {
+        static MemoryManager singleton_;
+        return singleton_;
+      }
+
+      template<typename... Args>
+      auto New(Args&&... args) -> Pointer<Tobj> {
+        Tobj* new_obj = nullptr;
+        TenantId tenant = TenantLedger::Current();
+        if (tenant != 0)
+          RequestTenantMemory(tenant);
+        MemoryChunk<Tobj>* chunk = FindNonFullChunk();
+        if (chunk == nullptr)
+          chunk = Grow();
+        assert(chunk != nullptr);
+        auto iter = Construct(chunk, tenant, std::forward<Args>(args)...);
+
+        new_obj = iter.GetPointer();
+        return MakePointer(iter);
+      }
+
+      void SetQuota(const Quota& quota) { quota_ = { std::min(quota.soft, quota.hard), quota.hard, quota.policy }; }
+
+#ifdef PERSISTENT_HEAP
+      /**
+       * @brief Moves this manager's chunks into a heap file, remapping the objects of a previous run
+       * if the file holds any. Must happen before any object of the type is allocated.
+       *
+       * @throws PersistentHeapException if the file cannot be used.
+       */
+      void OpenPersistent(const std::string& path) {
+        static_assert(std::is_trivially_copyable<Tobj>::value, "Only trivially copyable types can be persisted");
+        if (file_ != nullptr)
+          throw PersistentHeapException("Persistent heap is already open");
+        for (auto& chunk : chunk_list_) {
+          if (!chunk.IsEmpty())
+            throw PersistentHeapException("Objects were allocated before the persistent heap was opened");
+        }
+
+        PersistentFile::Header expected = {};
+        std::memcpy(expected.magic, PersistentFile::kMagic, sizeof(expected.magic));
+        expected.version = PersistentFile::kVersion;
+        expected.flags = PersistentFile::kFlags;
+        expected.type_hash = Fnv1a(typeid(Tobj).name(), std::strlen(typeid(Tobj).name()));
+        expected.type_size = sizeof(Tobj);
+        expected.chunk_size = CHUNK_SIZE;
+        size_t page = sysconf(_SC_PAGESIZE);
+        expected.chunk_bytes = (MemoryChunk<Tobj>::MappedLayout::kBytes + page - 1) / page * page;
+        expected.data_offset = (sizeof(PersistentFile::Header) + page - 1) / page * page;
+        auto file = std::make_unique<PersistentFile>(path, expected);
+
+        std::vector<unsigned char*> regions;
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < file->GetHeader().chunk_count; i++) {
+          regions.push_back(file->MapChunk(i));
+          checksum = MemoryChunk<Tobj>::Checksum(regions.back(), checksum);
+        }
+        if (!regions.empty() && checksum != file->GetHeader().checksum)
+          throw PersistentHeapException("Persistent heap file checksum mismatch");
+
+        chunk_list_.clear();
+        file_ = std::move(file);
+        for (size_t i = 0; i < regions.size(); i++) {
+          chunk_list_.emplace_back(regions[i], file_->ChunkOffset(i), &file_->GetHeader().clean, true);
+          mapped_chunks_.push_back(&chunk_list_.back());
+        }
+        if (chunk_list_.empty())
+          AddChunk();
+        file_->MarkDirty();
+      }
+
+      auto Pin(const Pointer<Tobj>& p) -> Handle<Tobj> {
+        if (p.ref_.pins == nullptr)
+          throw PersistentHeapException("Only objects of a persistent heap can be pinned");
+        ++*p.ref_.pins;
+        Header().clean = 0;
+        return Handle<Tobj>{ p.ref_.offset };
+      }
+      void Unpin(Handle<Tobj> h) { ChunkOf(h).Unpin(h.offset); }
+      auto Resolve(Handle<Tobj> h) -> Pointer<Tobj> { return MakePointer(ChunkOf(h).Acquire(h.offset)); }
+
+      void SetRoot(Handle<Tobj> h) {
+        Header().root = h.offset;
+        Header().clean = 0;
+      }
+      auto Root(void) -> Handle<Tobj> { return Handle<Tobj>{ Header().root }; }
+      // A checkpoint: the file opens again as it is now, until the next change to its bookkeeping.
+      void Sync(void) {
+        Header();
+        file_->MarkClean(Checksum());
+      }
+#endif
+
+    private:
+      std::list<MemoryChunk<Tobj>> chunk_list_;
+      Quota quota_;
+      LevelStats stats_;
+#ifdef PERSISTENT_HEAP
+      std::unique_ptr<PersistentFile> file_;
+      std::vector<MemoryChunk<Tobj>*> mapped_chunks_; // Chunk i of the heap file, for constant time handle lookup
+
+      auto Header(void) -> PersistentFile::Header& {
+        if (file_ == nullptr)
+          throw PersistentHeapException("No persistent heap is open for this type");
+        return file_->GetHeader();
+      }
+
+      auto Checksum(void) -> uint64_t {
+        uint64_t checksum = 0;
+        for (auto& chunk : chunk_list_)
+          checksum = chunk.Checksum(checksum);
+        return checksum;
+      }
+
+      auto ChunkOf(Handle<Tobj> h) -> MemoryChunk<Tobj>& {
+        auto& header = Header();
+        if (h.offset < header.data_offset || (h.offset - header.data_offset) / header.chunk_bytes >= mapped_chunks_.size())
+          throw PersistentHeapException("Handle does not refer to a live object");
+        return *mapped_chunks_[(h.offset - header.data_offset) / header.chunk_bytes];
+      }
+#endif
+
+      auto MakePointer(const typename MemoryChunk<Tobj>::Iterator& iter) -> Pointer<Tobj> {
+        Pointer<Tobj> ret(iter.GetPointer());
+        ret.ref_ = iter.GetSlotRef();
+        return ret;
+      }
+
+      // Constructors may allocate, so a non trivial one runs as part of this allocation.
+      template<typename... Args>
+      auto Construct(MemoryChunk<Tobj>* chunk, TenantId tenant, Args&&... args) -> typename MemoryChunk<Tobj>::Iterator {
+        if constexpr (std::is_trivially_constructible<Tobj, Args&&...>::value) {
+          return chunk->Allocate(tenant, std::forward<Args>(args)...);
+        }
+        else {
+          MemoryObserver::AllocationScope scope;
+          return chunk->Allocate(tenant, std::forward<Args>(args)...);
+        }
+      }
+
+      // Only runs once every chunk is full, so it is kept out of New. Coroutines waiting for the
+      // room a sweep made go first, once nothing else is in progress, and may leave none for this
+      // allocation.
+      __attribute__((noinline)) auto Grow(void) -> MemoryChunk<Tobj>* {
+        for (;;) {
+          {
+            MemoryObserver::AllocationScope scope;
+            if (RequestTypeMemory() && MemoryObserver::Get().RequestMemory(ChunkBytes(), [this]() { return FindNonFullChunk() != nullptr; }))
+              AddChunk();
+          }
+          MemoryObserver::Get().PollWaiters();
+          if (MemoryChunk<Tobj>* chunk = FindNonFullChunk())
+            return chunk;
+        }
+      }
+
+      __attribute__((noinline)) void RequestTenantMemory(TenantId tenant) {
+        {
+          MemoryObserver::AllocationScope scope;
+          MemoryObserver::Get().RequestTenantMemory(tenant, sizeof(Tobj));
+        }
+        MemoryObserver::Get().PollWaiters();
+      }
+
+      // The type's quota is applied before the global limits, so a type past its soft limit sweeps
+      // according to its own policy instead of putting the whole heap under pressure.
+      bool RequestTypeMemory(void) {
+        size_t bytes = UsedBytes();
+        if (quota_.soft == MemoryObserver::kUnlimited || bytes + ChunkBytes() <= quota_.soft)
+          return true;
+        if (quota_.policy != SweepPolicy::None) {
+          stats_.sweeps++;
+          if (quota_.policy == SweepPolicy::Own)
+            Sweep();
+          else
+            MemoryObserver::Get().SweepMemory();
+          if (FindNonFullChunk() != nullptr)
+            return false;
+        }
+        if (quota_.hard != MemoryObserver::kUnlimited && bytes + ChunkBytes() > quota_.hard) {
+          stats_.denials++;
+          throw MemoryLimitException();
+        }
+        return true;
+      }
+
+      void Sweep(void) {
+        SweepChunks([](MemoryChunk<Tobj>& chunk) { chunk.SweepManagedMem(); });
+      }
+
+      // Lets the coroutines waiting for memory retry once the sweep freed any slot.
+      template<typename SweepFunc>
+      void SweepChunks(const SweepFunc& sweep) {
+        size_t reclaimed = 0;
+        for (auto& chunk : chunk_list_) {
+          reclaimed += chunk.Size();
+          sweep(chunk);
+          reclaimed -= chunk.Size();
+        }
+        if (reclaimed != 0)
+          MemoryObserver::Get().MarkReclaimed();
+      }
+
+      // Memory one chunk really takes, its bookkeeping included, as charged to the limits.
+      auto ChunkBytes(void) -> size_t {
+#ifdef PERSISTENT_HEAP
+        if (file_ != nullptr)
+          return file_->GetHeader().chunk_bytes + MemoryChunk<Tobj>::kPopul * MemoryChunk<Tobj>::kDebugBytes;
+#endif
+        return MemoryChunk<Tobj>::kBytes;
+      }
+
+      // What the limits compare: every chunk and the tenant records made for them.
+      auto UsedBytes(void) -> size_t {
+        size_t bytes = ChunkBytes() * chunk_list_.size();
+        for (auto& chunk : chunk_list_)
+          bytes += chunk.TenantBytes();
+        return bytes;
+      }
+
+      void AddChunk(void) {
+#ifdef PERSISTENT_HEAP
+        if (file_ != nullptr) {
+          size_t i = chunk_list_.size();
+          unsigned char* region = file_->MapChunk(i);
+          chunk_list_.emplace_back(region, file_->ChunkOffset(i), &file_->GetHeader().clean, false);
+          mapped_chunks_.push_back(&chunk_list_.back());
+          return;
+        }
+#endif
+        chunk_list_.emplace_back();
+      }
+
+      auto FindNonFullChunk(void) -> MemoryChunk<Tobj>* {
+        for (auto& chunk : chunk_list_) {
+          if (!chunk.IsFull())
+            return &chunk;
+        }
+        return nullptr;
+      }
+
+      MemoryManager() {
+        chunk_list_.emplace_back();
+        MemoryObserver::Get().RegisterObserver(
+          [this]() {
+            return UsedBytes();
+          }
+        );
+        MemoryObserver::Get().RegisterSweeper(
+          [this]() {
+            Sweep();
+          }
+        );
+        MemoryObserver::Get().RegisterTenantSweeper(
+          [this](TenantId tenant) {
+            SweepChunks([tenant](MemoryChunk<Tobj>& chunk) { chunk.SweepTenant(tenant); });
+          }
+        );
+        MemoryObserver::Get().RegisterPrint(
+          [this]() {
+            for (auto& chunk : chunk_list_)
+              std::cout << chunk << "\n-------------------------------\n";
+          }
+        );
+        MemoryObserver::Get().RegisterStats(
+          [this](MemoryStats& out) {
+            auto& stats = out.types[typeid(Tobj).name()] = stats_;
+            stats.bytes = UsedBytes();
+            for (auto& chunk : chunk_list_)
+              stats.objects += chunk.Size();
+            stats.soft = quota_.soft;
+            stats.hard = quota_.hard;
+          }
+        );
+      }
+      MemoryManager(const MemoryManager&) = delete;
+      MemoryManager(MemoryManager&&) = delete;
+      ~MemoryManager() {
+#ifdef PERSISTENT_HEAP
+        if (file_ != nullptr) {
+          uint64_t checksum = Checksum();
+          mapped_chunks_.clear();
+          chunk_list_.clear();
+          file_->MarkClean(checksum);
+        }
+#endif
+        chunk_list_.clear();
+      }
+    };
+
+  } // namespace
+
+  template <typename Tobj>
+  class Pointer {
+  public:
+    Pointer(Tobj* obj = nullptr) : ptr_(obj) {}
+    Pointer(const Pointer& _obj) : ptr_(_obj.ptr_), ref_(_obj.ref_) {
+      Retain();
+    }
+    Pointer(Pointer&& _obj) noexcept : ptr_(_obj.ptr_), ref_(_obj.ref_) {
+      _obj.ptr_ = nullptr;
+      _obj.ref_ = detail::SlotRef();
+    }
+    ~Pointer() {
+      Release();
+    }
+
+    auto operator=(const Pointer& _obj) -> Pointer& {
+      if (this != &_obj) {
+        Release();
+        ptr_ = _obj.ptr_;
+        ref_ = _obj.ref_;
+        Retain();
+      }
+      return *this;
+    }
+    auto operator=(Pointer&& _obj) noexcept -> Pointer& {
+      if (this != &_obj) {
+        Release();
+        ptr_ = _obj.ptr_;
+        ref_ = _obj.ref_;
+        _obj.ptr_ = nullptr;
+        _obj.ref_ = detail::SlotRef();
+      }
+      return *this;
+    }
+
+    auto Get() const -> Tobj& { return *Checked(); }
+    auto Get() -> Tobj& { return *Checked(); }
+
+    auto operator*(void) -> Tobj& { return *Checked(); }
+    auto operator*(void) const -> Tobj& { return *Checked(); }
+    auto operator->(void) -> Tobj& { return *Checked(); }
+    auto operator->(void) const -> Tobj& { return *Checked(); }
 
     friend auto operator<<(std::ostream& os, const Pointer<Tobj>& p) -> std::ostream& {
       return os << p.Get();
@@ -359,10 +1854,305 @@ namespace memman {
     friend class MemoryManager<Tobj>;
 
   private:
-    using CountCtrl = std::function<void(int)>;
     Tobj* ptr_;
-    CountCtrl cnt_ctrlr_;
+    detail::SlotRef ref_;
+
+#ifdef HARDENED
+    // The slot generation moves on once a sweep reclaims the object, so a mismatch means
+    // this Pointer outlived its object.
+    bool IsStale(void) const { return ref_.generation != nullptr && *ref_.generation != ref_.tag; }
+#endif
+
+    auto Checked(void) const -> Tobj* {
+#ifdef HARDENED
+      if (IsStale())
+        hardening::Report("use after free", typeid(Tobj).name(), ptr_);
+#endif
+      return ptr_;
+    }
+
+    bool IsPinned(void) const {
+#ifdef PERSISTENT_HEAP
+      return ref_.pins != nullptr && *ref_.pins != 0;
+#else
+      return false;
+#endif
+    }
+
+    void Retain(void) {
+      if (ref_.count == nullptr)
+        return;
+#ifdef HARDENED
+      if (IsStale())
+        return hardening::Report("copy after free", typeid(Tobj).name(), ptr_);
+#endif
+      ++*ref_.count;
+    }
+    void Release(void) {
+      if (ref_.count == nullptr)
+        return;
+#ifdef HARDENED
+      if (IsStale())
+        return hardening::Report("release after free", typeid(Tobj).name(), ptr_);
+      if (*ref_.count == 0)
+        return hardening::Report("double release", typeid(Tobj).name(), ptr_);
+#endif
+      if (--*ref_.count == 0 && !IsPinned())
+        *ref_.released |= ref_.released_mask;
+    }
+  };
+
+#ifdef SHARED_POOL
+  template <typename Tobj>
+  class SharedPool;
+
+  /**
+   * @brief Reference to an object of a SharedPool that can be sent to another process, which
+   * takes it over with SharedPool::Adopt.
+   */
+  struct SharedHandle {
+    uint32_t index;
+  };
+
+  /**
+   * @brief Counted reference to an object of a SharedPool. The count lives in the shared region,
+   * so references held by different processes keep the object alive together.
+   */
+  template <typename Tobj>
+  class SharedPointer {
+  public:
+    SharedPointer() = default;
+    SharedPointer(const SharedPointer& _obj) : pool_(_obj.pool_), index_(_obj.index_) {
+      if (pool_ != nullptr)
+        pool_->Retain(index_);
+    }
+    SharedPointer(SharedPointer&& _obj) noexcept : pool_(_obj.pool_), index_(_obj.index_) {
+      _obj.pool_ = nullptr;
+    }
+    ~SharedPointer() {
+      if (pool_ != nullptr)
+        pool_->Release(index_);
+    }
+
+    auto operator=(SharedPointer _obj) -> SharedPointer& {
+      std::swap(pool_, _obj.pool_);
+      std::swap(index_, _obj.index_);
+      return *this;
+    }
+
+    auto Get() const -> Tobj& { return pool_->Object(index_); }
+    auto operator*(void) const -> Tobj& { return Get(); }
+    auto operator->(void) const -> Tobj* { return &Get(); }
+
+    friend class SharedPool<Tobj>;
+
+  private:
+    SharedPool<Tobj>* pool_ = nullptr;
+    uint32_t index_ = 0;
+
+    SharedPointer(SharedPool<Tobj>* pool, uint32_t index) : pool_(pool), index_(index) {}
+  };
+
+  /**
+   * @brief Pool of objects in POSIX shared memory that several processes map, so that producers
+   * can hand objects to consumers without copying them. Counts are atomic and free slots form a
+   * lock-free stack, so every process allocates and releases on its own.
+   *
+   * @tparam Tobj Trivially copyable type of the objects, as it is shared between processes.
+   */
+  template <typename Tobj>
+  class SharedPool final {
+  public:
+    /**
+     * @brief Creates the named pool, or attaches to it when another process created it first.
+     *
+     * @param name shm_open name, such as "/frames".
+     * @param chunks Capacity of the pool, in chunks of CHUNK_SIZE.
+     * @throws SharedPoolException if the region cannot be mapped or holds another type.
+     */
+    SharedPool(const std::string& name, size_t chunks) {
+      int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+      bool create = fd >= 0;
+      if (!create)
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+      Setup(fd, create, chunks);
+    }
+
+    /**
+     * @brief Creates an anonymous pool in a memfd, to be shared with forked children or passed
+     * to other processes over a unix socket.
+     */
+    explicit SharedPool(size_t chunks) { Setup(memfd_create("memman", MFD_CLOEXEC), true, chunks); }
+
+    /**
+     * @brief Attaches to a pool through a memfd received from the process that created it.
+     */
+    static auto Attach(int fd) -> std::unique_ptr<SharedPool> { return std::unique_ptr<SharedPool>(new SharedPool(fd, AttachTag())); }
+
+    SharedPool(const SharedPool&) = delete;
+    SharedPool(SharedPool&&) = delete;
+    ~SharedPool() {
+      munmap(header_, bytes_);
+      close(fd_);
+    }
+
+    static void Unlink(const std::string& name) { shm_unlink(name.c_str()); }
+
+    template<typename... Args>
+    auto Allocate(Args&&... args) -> SharedPointer<Tobj> {
+      uint32_t index = Pop();
+      new (slots_[index].obj) Tobj(std::forward<Args>(args)...);
+      slots_[index].count.store(1, std::memory_order_release);
+      return SharedPointer<Tobj>(this, index);
+    }
+
+    /**
+     * @brief Takes a reference on behalf of the process the handle is sent to.
+     */
+    auto Share(const SharedPointer<Tobj>& p) -> SharedHandle {
+      Retain(p.index_);
+      return SharedHandle{ p.index_ };
+    }
+
+    /**
+     * @brief Takes over the reference a handle received from another process carries.
+     */
+    auto Adopt(SharedHandle h) -> SharedPointer<Tobj> {
+      if (h.index >= header_->capacity || slots_[h.index].count.load(std::memory_order_acquire) == 0)
+        throw SharedPoolException("Handle does not refer to a live object");
+      return SharedPointer<Tobj>(this, h.index);
+    }
+
+    auto Capacity(void) const -> size_t { return header_->capacity; }
+    auto Fd(void) const -> int { return fd_; }
+
+    friend class SharedPointer<Tobj>;
+
+  private:
+    static_assert(std::is_trivially_copyable<Tobj>::value, "Only trivially copyable types can be shared");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared counts need address-free atomics");
+
+    static constexpr char kMagic[8] = "MEMSHM";
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kEnd = ~uint32_t(0);
+
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      std::atomic<uint32_t> ready; // Set once the creator has linked the free slots
+      uint64_t type_hash;
+      uint64_t type_size;
+      uint64_t capacity;
+      std::atomic<uint64_t> free_head; // Tag in the high half against ABA, slot index in the low
+    };
+
+    struct SharedSlot {
+      std::atomic<uint32_t> count;
+      std::atomic<uint32_t> next;
+      alignas(Tobj) unsigned char obj[sizeof(Tobj)];
+    };
+
+    int fd_ = -1;
+    Header* header_ = nullptr;
+    SharedSlot* slots_ = nullptr;
+    size_t bytes_ = 0;
+
+    struct AttachTag {};
+
+    SharedPool(int fd, AttachTag) { Setup(fd, false, 0); }
+
+    static auto SlotsOffset(void) -> size_t { return (sizeof(Header) + alignof(SharedSlot) - 1) / alignof(SharedSlot) * alignof(SharedSlot); }
+    static auto TypeHash(void) -> uint64_t { return Fnv1a(typeid(Tobj).name(), std::strlen(typeid(Tobj).name())); }
+
+    void Setup(int fd, bool create, size_t chunks) {
+      if (fd < 0)
+        throw SharedPoolException("Cannot open shared memory");
+      fd_ = fd;
+      if (create) {
+        size_t capacity = chunks * (CHUNK_SIZE / sizeof(SharedSlot));
+        if (capacity >= kEnd)
+          Fail("Shared pool too large");
+        bytes_ = SlotsOffset() + capacity * sizeof(SharedSlot);
+        if (ftruncate(fd_, bytes_) != 0)
+          Fail("Cannot size shared memory");
+        Map();
+        std::memcpy(header_->magic, kMagic, sizeof(kMagic));
+        header_->version = kVersion;
+        header_->type_hash = TypeHash();
+        header_->type_size = sizeof(Tobj);
+        header_->capacity = capacity;
+        for (size_t i = 0; i < capacity; i++) {
+          slots_[i].count.store(0, std::memory_order_relaxed);
+          slots_[i].next.store(i + 1 < capacity ? i + 1 : kEnd, std::memory_order_relaxed);
+        }
+        header_->free_head.store(capacity > 0 ? 0 : kEnd, std::memory_order_relaxed);
+        header_->ready.store(1, std::memory_order_release);
+        return;
+      }
+      struct stat st;
+      for (int tries = 0; fstat(fd_, &st) == 0 && size_t(st.st_size) < sizeof(Header); tries++) {
+        if (tries == 1000)
+          Fail("Shared pool was never initialized");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      bytes_ = st.st_size;
+      Map();
+      for (int tries = 0; header_->ready.load(std::memory_order_acquire) != 1; tries++) {
+        if (tries == 1000)
+          Fail("Shared pool was never initialized");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 || header_->version != kVersion)
+        Fail("Not a shared pool");
+      if (header_->type_hash != TypeHash() || header_->type_size != sizeof(Tobj))
+        Fail("Shared pool holds another type");
+      if (bytes_ < SlotsOffset() + header_->capacity * sizeof(SharedSlot))
+        Fail("Shared pool is truncated");
+    }
+
+    void Map(void) {
+      void* mem = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      if (mem == MAP_FAILED)
+        Fail("Cannot map shared memory");
+      header_ = static_cast<Header*>(mem);
+      slots_ = reinterpret_cast<SharedSlot*>(static_cast<unsigned char*>(mem) + SlotsOffset());
+    }
+
+    [[noreturn]] void Fail(const char* reason) {
+      if (header_ != nullptr)
+        munmap(header_, bytes_);
+      close(fd_);
+      throw SharedPoolException(reason);
+    }
+
+    auto Pop(void) -> uint32_t {
+      uint64_t head = header_->free_head.load(std::memory_order_acquire);
+      for (;;) {
+        uint32_t index = uint32_t(head);
+        if (index == kEnd)
+          throw MemoryLimitException();
+        uint64_t next = ((head >> 32) + 1) << 32 | slots_[index].next.load(std::memory_order_relaxed);
+        if (header_->free_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire))
+          return index;
+      }
+    }
+
+    void Push(uint32_t index) {
+      uint64_t head = header_->free_head.load(std::memory_order_relaxed);
+      do {
+        slots_[index].next.store(uint32_t(head), std::memory_order_relaxed);
+      } while (!header_->free_head.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | index,
+        std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void Retain(uint32_t index) { slots_[index].count.fetch_add(1, std::memory_order_relaxed); }
+    void Release(uint32_t index) {
+      if (slots_[index].count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        Push(index);
+    }
+    auto Object(uint32_t index) -> Tobj& { return *reinterpret_cast<Tobj*>(slots_[index].obj); }
   };
+#endif
 
   /**
    * @brief Allocates memory for the object and returns a pointer to it through a wrapper.
@@ -373,12 +2163,391 @@ namespace memman {
    * @return Pointer<Tobj> The Wrapper containing the allocated pointer.
    */
   template<typename Tobj, typename... Args>
-  auto make_pointer(Args&&... args) -> Pointer<Tobj> { return MemoryManager<Tobj>::Get().New(std::forward<Args>(args)...); }
+  MAKE_POINTER_ATTR auto make_pointer(Args&&... args) -> Pointer<Tobj> {
+#ifdef HARDENED
+    hardening::current_site = __builtin_return_address(0);
+#endif
+    return MemoryManager<Tobj>::Get().New(std::forward<Args>(args)...);
+  }
+
+  /**
+   * @brief Orders a memory sweep, then retries the allocations of coroutines suspended in allocate.
+   * Called during an allocation, from a pressure callback or a constructor, the retry waits for
+   * that allocation to return.
+   */
+  void sweep_memory(void) {
+    {
+      MemoryObserver::AllocationScope scope; // Destructors run by the sweep may allocate
+      MemoryObserver::Get().SweepMemory();
+    }
+    if (!MemoryObserver::InAllocation())
+      MemoryObserver::Get().ResumeWaiters();
+  }
+
+  /**
+   * @brief Sets the memory limits, overriding HEAP_SIZE and MEM_THRESH.
+   *
+   * @param soft Bytes past which pressure callbacks run and memory is swept before growing.
+   * @param hard Bytes that managed memory may not grow past, save for the emergency reserve.
+   */
+  void set_memory_limits(size_t soft, size_t hard) { MemoryObserver::Get().SetLimits(soft, hard); }
+
+  /**
+   * @brief Sets how many bytes past the hard limit may be used once nothing else can be freed.
+   *
+   * @param bytes Size of the emergency reserve, RESERVE_CHUNKS chunks by default.
+   */
+  void set_memory_reserve(size_t bytes) { MemoryObserver::Get().SetReserve(bytes); }
+
+  /**
+   * @brief Caps the hard limit to CGROUP_MEM_SHARE percent of the container's cgroup memory limit,
+   * minus the reserve, so that even the reserve stays inside the container. The cgroup limit is
+   * re-read whenever memory is requested. Enabled from the start when CGROUP_MEM_LIMIT is defined.
+   *
+   * @param follow Whether to follow the cgroup limit.
+   */
+  void follow_cgroup_limit(bool follow = true) { MemoryObserver::Get().FollowCgroupLimit(follow); }
+
+  /**
+   * @brief Sets what allocations do once the hard limit is reached.
+   *
+   * @param mode NonBlocking fails right away, Blocking retries until the timeout expires.
+   * @param timeout How long a blocking allocation keeps retrying.
+   */
+  void set_allocation_mode(AllocationMode mode, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+    MemoryObserver::Get().SetAllocationMode(mode, timeout);
+  }
+
+  /**
+   * @brief Registers a callback invoked under memory pressure, so that caches can drop the
+   * pointers they hold before memory is swept.
+   *
+   * @param callback Invoked with the current pressure level.
+   * @return size_t Id to unregister the callback with.
+   */
+  auto on_memory_pressure(const std::function<void(PressureLevel)>& callback) -> size_t {
+    return MemoryObserver::Get().RegisterPressureCallback(callback);
+  }
+
+  /**
+   * @brief Unregisters a memory pressure callback.
+   *
+   * @param id Id returned by on_memory_pressure.
+   */
+  void remove_memory_pressure_callback(size_t id) { MemoryObserver::Get().UnregisterPressureCallback(id); }
+
+  /**
+   * @brief Sets the quota of a type, checked before the global limits whenever the type's manager
+   * needs a new chunk. Past the soft limit the type is swept according to the quota's policy, at
+   * the hard limit allocations throw MemoryLimitException.
+   */
+  template<typename Tobj>
+  void set_type_quota(const Quota& quota) { MemoryManager<Tobj>::Get().SetQuota(quota); }
+
+  /**
+   * @brief Sets the quota of a tenant, checked on every allocation made while the tenant is current.
+   * The tenant is swept when it first goes past the soft limit and when it reaches the hard limit,
+   * at most once a millisecond while sweeps leave it past the soft limit. At the hard limit
+   * allocations throw MemoryLimitException.
+   */
+  void set_tenant_quota(TenantId tenant, const Quota& quota) { TenantLedger::Get().SetQuota(tenant, quota); }
+
+  /**
+   * @brief Makes a tenant current on this thread for its lifetime: objects allocated meanwhile are
+   * charged to it. Scopes nest, the previous tenant is current again once the scope ends.
+   */
+  class TenantScope {
+  public:
+    explicit TenantScope(TenantId tenant) : previous_(TenantLedger::Current()) { TenantLedger::SetCurrent(tenant); }
+    ~TenantScope() { TenantLedger::SetCurrent(previous_); }
+    TenantScope(const TenantScope&) = delete;
+    TenantScope& operator=(const TenantScope&) = delete;
+
+  private:
+    TenantId previous_;
+  };
+
+  /**
+   * @brief Accounting of the global, per type and per tenant quota levels.
+   */
+  auto memory_stats(void) -> MemoryStats { return MemoryObserver::Get().Stats(); }
+
+  /**
+   * @brief Sets the average number of bytes allocated between two objects sampled by the heap
+   * profiler. Only has an effect when built with HEAP_PROFILE.
+   *
+   * @param bytes Sample rate, 0 stops sampling.
+   */
+  void set_heap_sample_rate(size_t bytes) {
+#ifdef HEAP_PROFILE
+    HeapProfiler::Get().SetSampleRate(bytes);
+#else
+    (void)bytes;
+#endif
+  }
+
+  /**
+   * @brief Writes the sampled allocation sites and their live objects in pprof's heap format.
+   * Writes nothing unless built with HEAP_PROFILE.
+   *
+   * @param os Stream to write the profile to.
+   */
+  void dump_heap_profile(std::ostream& os) {
+#ifdef HEAP_PROFILE
+    HeapProfiler::Get().Dump(os);
+#else
+    (void)os;
+#endif
+  }
+
+#ifdef PERSISTENT_HEAP
+  /**
+   * @brief Keeps the objects of a type in a heap file, so that a restarted process can remap them
+   * instead of rebuilding them. Must be called before the first make_pointer of the type. Objects
+   * a previous run left pinned are back, all others are released.
+   *
+   * @tparam Tobj Trivially copyable type of the objects.
+   * @param path Heap file, created if it does not exist.
+   * @throws PersistentHeapException if the file belongs to another type or build, or changed after
+   * its last sync_persistent_heap without the process exiting normally.
+   */
+  template<typename Tobj>
+  void open_persistent_heap(const std::string& path) { MemoryManager<Tobj>::Get().OpenPersistent(path); }
+
+  /**
+   * @brief Keeps a persistent object alive without a Pointer, across restarts too, until unpinned.
+   *
+   * @return Handle<Tobj> Handle to store in other persistent objects or as the root.
+   */
+  template<typename Tobj>
+  auto pin(const Pointer<Tobj>& p) -> Handle<Tobj> { return MemoryManager<Tobj>::Get().Pin(p); }
+
+  /**
+   * @brief Drops a pin taken with pin.
+   */
+  template<typename Tobj>
+  void unpin(Handle<Tobj> h) { MemoryManager<Tobj>::Get().Unpin(h); }
+
+  /**
+   * @brief Returns a Pointer to the object a handle refers to.
+   */
+  template<typename Tobj>
+  auto resolve(Handle<Tobj> h) -> Pointer<Tobj> { return MemoryManager<Tobj>::Get().Resolve(h); }
+
+  /**
+   * @brief Records the handle a restarted process starts walking its objects from.
+   */
+  template<typename Tobj>
+  void set_persistent_root(Handle<Tobj> h) { MemoryManager<Tobj>::Get().SetRoot(h); }
+
+  template<typename Tobj>
+  auto persistent_root(void) -> Handle<Tobj> { return MemoryManager<Tobj>::Get().Root(); }
+
+  /**
+   * @brief Checkpoints a persistent heap: flushes it to its file and marks the file consistent, so
+   * that it opens again even if the process is then killed. The next allocation, sweep, pin or
+   * root change marks it inconsistent again until the next sync or a normal exit. Object contents
+   * are flushed but not checked.
+   */
+  template<typename Tobj>
+  void sync_persistent_heap(void) { MemoryManager<Tobj>::Get().Sync(); }
+#endif
+
+#ifdef COROUTINES_ENABLED
+  namespace {
+
+    /**
+     * @brief Size classed pool for coroutine frames. Each class carves CHUNK_SIZE chunks into
+     * blocks kept on a free list, chunks are requested from the MemoryObserver like any other.
+     */
+    class FrameAllocator final {
+    public:
+      static constexpr size_t kMinBlock = 64;
+      static constexpr size_t kClasses = 7; // 64 B to 4 KB, larger frames go to operator new
+
+    public:
+      static auto Get(void) -> FrameAllocator& {
+        static FrameAllocator singleton;
+        return singleton;
+      }
+
+      // Returns nullptr when the limits leave no room for the frame.
+      auto TryAllocate(size_t size) noexcept -> void* {
+        try {
+          return Allocate(size);
+        }
+        catch (std::exception&) { // MemoryLimitException, or std::bad_alloc for large frames
+          return nullptr;
+        }
+      }
+
+      auto Allocate(size_t size) -> void* {
+        size_t c = SizeClass(size);
+        if (c == kClasses)
+          return ::operator new(size);
+        if (classes_[c].free == nullptr)
+          Grow(c);
+        FreeBlock* block = classes_[c].free;
+        classes_[c].free = block->next;
+        return block;
+      }
+
+      void Deallocate(void* p, size_t size) {
+        size_t c = SizeClass(size);
+        if (c == kClasses)
+          return ::operator delete(p);
+        classes_[c].free = new (p) FreeBlock{ classes_[c].free };
+      }
+
+    private:
+      struct FreeBlock {
+        FreeBlock* next;
+      };
+      struct Class {
+        FreeBlock* free = nullptr;
+        std::vector<unsigned char*> chunks;
+      };
+
+      Class classes_[kClasses];
+
+      // Blocks must fit in a chunk, larger frames go to operator new too.
+      static auto SizeClass(size_t size) -> size_t {
+        size_t c = 0;
+        for (size_t block = kMinBlock; c < kClasses && block < size; block <<= 1)
+          c++;
+        return c < kClasses && (kMinBlock << c) <= CHUNK_SIZE ? c : kClasses;
+      }
+
+      void Grow(size_t c) {
+        if (!MemoryObserver::Get().RequestMemory(CHUNK_SIZE, [this, c]() { return classes_[c].free != nullptr; }))
+          return;
+        size_t block = kMinBlock << c;
+        unsigned char* chunk = static_cast<unsigned char*>(::operator new(CHUNK_SIZE));
+        classes_[c].chunks.push_back(chunk);
+        for (size_t offset = CHUNK_SIZE / block * block; offset != 0; offset -= block)
+          classes_[c].free = new (chunk + offset - block) FreeBlock{ classes_[c].free };
+      }
+
+      FrameAllocator() {
+        MemoryObserver::Get().RegisterObserver(
+          [this]() {
+            size_t chunks = 0;
+            for (auto& c : classes_)
+              chunks += c.chunks.size();
+            return CHUNK_SIZE * chunks;
+          }
+        );
+      }
+      FrameAllocator(const FrameAllocator&) = delete;
+      FrameAllocator(FrameAllocator&&) = delete;
+      ~FrameAllocator() {
+        for (auto& c : classes_) {
+          for (auto chunk : c.chunks)
+            ::operator delete(chunk);
+        }
+      }
+    };
+
+  } // namespace
+
+  /**
+   * @brief Base for coroutine promise types whose frames should come from memman's pooled chunks.
+   * A frame that does not fit in the limits throws std::bad_alloc from the coroutine call.
+   */
+  struct PooledFrame {
+    static auto operator new(size_t size) -> void* {
+      void* frame = FrameAllocator::Get().TryAllocate(size);
+      if (frame == nullptr)
+        throw std::bad_alloc();
+      return frame;
+    }
+    static void operator delete(void* p, size_t size) { FrameAllocator::Get().Deallocate(p, size); }
+  };
+
+  /**
+   * @brief Base for promise types that define get_return_object_on_allocation_failure: a frame
+   * that does not fit in the limits makes the coroutine call return that object instead.
+   */
+  struct NothrowPooledFrame {
+    static auto operator new(size_t size) noexcept -> void* { return FrameAllocator::Get().TryAllocate(size); }
+    static void operator delete(void* p, size_t size) { FrameAllocator::Get().Deallocate(p, size); }
+  };
+
+  /**
+   * @brief Awaitable allocation: completes right away when memory is available, otherwise the
+   * coroutine is suspended and resumed once a sweep made room for it.
+   */
+  template<typename Tobj, typename... Args>
+  class AllocationAwaiter {
+  public:
+    AllocationAwaiter(Args... args) : args_(std::move(args)...) {}
+    AllocationAwaiter(const AllocationAwaiter&) = delete;
+    AllocationAwaiter(AllocationAwaiter&&) = delete;
+    // A coroutine destroyed while suspended must not be resumed by the next sweep.
+    ~AllocationAwaiter() {
+      if (waiter_id_)
+        MemoryObserver::Get().UnregisterWaiter(*waiter_id_);
+    }
+
+    bool await_ready(void) { return TryAllocate(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+      waiter_id_ = MemoryObserver::Get().RegisterWaiter(
+        [this, handle]() {
+          if (!TryAllocate())
+            return false;
+          MemoryObserver::Get().UnregisterWaiter(*waiter_id_);
+          waiter_id_.reset();
+          handle.resume();
+          return true;
+        }
+      );
+    }
+    auto await_resume(void) -> Pointer<Tobj> { return std::move(*result_); }
+
+  private:
+    std::tuple<Args...> args_;
+    std::optional<Pointer<Tobj>> result_;
+    std::optional<size_t> waiter_id_;
+
+    bool TryAllocate(void) {
+      MemoryObserver::NonBlockingScope scope;
+      try {
+        result_.emplace(std::apply([](auto&... args) { return make_pointer<Tobj>(args...); }, args_));
+        return true;
+      }
+      catch (MemoryLimitException&) {
+        return false;
+      }
+    }
+  };
 
   /**
-   * @brief Orders a memory sweep.
+   * @brief Allocates an object from a coroutine, suspending it while memory is under pressure.
+   * Suspended coroutines are retried, oldest first, once a sweep reclaimed memory: by sweep_memory,
+   * or, for sweeps triggered by pressure or quotas, by the outermost allocation that ran them once
+   * they are done, so that no coroutine is resumed in the middle of one. An allocation that failed
+   * after such a sweep leaves the retry to the next one that grows or sweeps, or to poll. Destroying a suspended coroutine
+   * takes its allocation out of the queue.
    *
+   * @tparam Tobj Type of object to be allocated.
+   * @param args Constructor arguments, copied into the awaiter until the allocation succeeds.
+   * @return Awaitable whose result is the Pointer to the new object.
    */
-  void sweep_memory(void) { MemoryObserver::Get().SweepMemory(); }
+  template<typename Tobj, typename... Args>
+  auto allocate(Args&&... args) -> AllocationAwaiter<Tobj, std::decay_t<Args>...> {
+    return AllocationAwaiter<Tobj, std::decay_t<Args>...>(std::forward<Args>(args)...);
+  }
+
+  /**
+   * @brief Number of coroutines suspended in allocate, waiting for a sweep to make room.
+   */
+  auto pending_allocations(void) -> size_t { return MemoryObserver::Get().WaiterCount(); }
+
+  /**
+   * @brief Retries the allocations of suspended coroutines if a sweep reclaimed memory since they
+   * were last tried, for event loops to call between tasks. Does nothing during an allocation.
+   */
+  void poll(void) { MemoryObserver::Get().PollWaiters(); }
+#endif
 
 } // namespace memman
@@ -0,0 +1,167 @@
+#include "model.hpp"
+#include <coroutine>
+#include <utility>
+
+/**
+ * Coroutines waiting in allocate while a type's chunks are full and the limits leave no room
+ * to grow: resumed by a pressure sweep of a plain allocation, by sweep_memory and by poll,
+ * destroyed while suspended, and frames refused at the limits.
+ * Usage: coroutines
+ */
+
+struct Wide {
+  uint64_t v[4] = {};
+};
+
+// Makes the call that creates a frame at the limits return an empty Task.
+template <typename Task, bool = true>
+struct OnAllocationFailure {
+  static auto get_return_object_on_allocation_failure() -> Task { return Task(nullptr); }
+};
+
+template <typename Task>
+struct OnAllocationFailure<Task, false> {};
+
+// Lazily started coroutine, destroying its frame with it.
+template <typename Frame>
+class Task {
+public:
+  struct promise_type : Frame, OnAllocationFailure<Task, std::is_same<Frame, memman::NothrowPooledFrame>::value> {
+    auto get_return_object() -> Task { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    auto initial_suspend() noexcept -> std::suspend_always { return {}; }
+    auto final_suspend() noexcept -> std::suspend_always { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(std::nullptr_t) {}
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  Task(Task&& other) : handle_(std::exchange(other.handle_, nullptr)) {}
+  ~Task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  void Start(void) { handle_.resume(); }
+  bool Valid(void) const { return bool(handle_); }
+  bool Done(void) const { return handle_.done(); }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename Frame>
+static auto AllocateOne(uint64_t value, uint64_t& out) -> Task<Frame> {
+  memman::Pointer<uint64_t> obj = co_await memman::allocate<uint64_t>(value);
+  out = *obj;
+}
+
+// Allocates until the chunks of the type are full and the limits refuse to grow them.
+template <typename Tobj>
+static void Fill(std::vector<memman::Pointer<Tobj>>& held) {
+  try {
+    for (;;)
+      held.push_back(memman::make_pointer<Tobj>());
+  }
+  catch (memman::MemoryLimitException&) {
+  }
+}
+
+static void Drop(std::vector<memman::Pointer<uint64_t>>& held) { held.resize(held.size() / 2); }
+
+// Nothing can grow past the memory in use.
+static void Lock(void) {
+  size_t used = memman::memory_stats().global.bytes;
+  memman::set_memory_limits(used, used);
+}
+
+template <typename Frame>
+static void CheckSuspended(Task<Frame>& task, const char* what) {
+  task.Start();
+  if (task.Done() || memman::pending_allocations() != 1)
+    Fail(std::string(what) + ": allocation did not wait for room");
+}
+
+template <typename Frame>
+static void CheckResumed(Task<Frame>& task, uint64_t out, uint64_t value, const char* what) {
+  if (!task.Done() || out != value || memman::pending_allocations() != 0)
+    Fail(std::string(what) + ": waiting allocation was not resumed");
+}
+
+static void Run(void) {
+  std::vector<memman::Pointer<uint64_t>> words;
+  std::vector<memman::Pointer<Wide>> wides;
+  memman::set_memory_reserve(0);
+  Fill(words);
+  Lock();
+
+  uint64_t out[4] = {};
+  if (AllocateOne<memman::NothrowPooledFrame>(0, out[0]).Valid())
+    Fail("frame was allocated past the limits");
+  try {
+    AllocateOne<memman::PooledFrame>(0, out[0]);
+    Fail("frame was allocated past the limits");
+  }
+  catch (std::bad_alloc&) {
+  }
+
+  memman::set_memory_limits(~size_t(0), ~size_t(0));
+  auto by_pressure = AllocateOne<memman::NothrowPooledFrame>(1, out[0]);
+  auto by_sweep = AllocateOne<memman::PooledFrame>(2, out[1]);
+  auto destroyed = std::make_unique<Task<memman::PooledFrame>>(AllocateOne<memman::PooledFrame>(3, out[2]));
+  auto by_poll = AllocateOne<memman::PooledFrame>(4, out[3]);
+  if (!by_pressure.Valid())
+    Fail("frame was refused below the limits");
+  Lock();
+  Fill(words);
+  Fill(wides);
+
+  CheckSuspended(by_pressure, "pressure sweep");
+  Drop(words);
+  words.push_back(memman::make_pointer<uint64_t>(0));
+  CheckResumed(by_pressure, out[0], 1, "pressure sweep");
+
+  Fill(words);
+  CheckSuspended(by_sweep, "sweep_memory");
+  Drop(words);
+  memman::sweep_memory();
+  CheckResumed(by_sweep, out[1], 2, "sweep_memory");
+
+  Fill(words);
+  CheckSuspended(*destroyed, "destroyed");
+  destroyed.reset();
+  if (memman::pending_allocations() != 0)
+    Fail("destroyed coroutine is still waiting");
+  Drop(words);
+  memman::sweep_memory();
+  if (out[2] != 0)
+    Fail("destroyed coroutine was resumed");
+
+  Fill(words);
+  CheckSuspended(by_poll, "poll");
+  Drop(words);
+  try {
+    memman::make_pointer<Wide>(); // Sweeps, then fails: the waiter is left to poll
+    Fail("chunk was added past the limits");
+  }
+  catch (memman::MemoryLimitException&) {
+  }
+  if (by_poll.Done())
+    Fail("poll: waiter was resumed by a failing allocation");
+  memman::poll();
+  CheckResumed(by_poll, out[3], 4, "poll");
+}
+
+int
+main() {
+  try {
+    Run();
+  }
+  catch (std::exception& e) {
+    std::cerr << "coroutines failed: " << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "coroutines passed" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#include "model.hpp"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+/**
+ * libFuzzer target: every 5 bytes of input are one operation of the model harness, followed by a
+ * sweep and a full check. Build with clang++ -fsanitize=fuzzer,address, or with STANDALONE_FUZZER
+ * to replay inputs given as files with any compiler.
+ */
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  Harness harness;
+  for (size_t i = 0; i + 5 <= size; i += 5) {
+    uint16_t a;
+    uint16_t b;
+    std::memcpy(&a, data + i + 1, sizeof(a));
+    std::memcpy(&b, data + i + 3, sizeof(b));
+    harness.Step(data[i], a, b);
+  }
+  memman::sweep_memory();
+  harness.Check(true);
+  return 0;
+}
+
+#ifdef STANDALONE_FUZZER
+int
+main(int argc, char const* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "../../mem_man.hpp"
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Object with a non trivial destructor and an out of line count, counting its live instances
+ * so that the harness can tell every reclaimed object was destroyed exactly once.
+ */
+struct Tracked {
+  static constexpr uint64_t kCanary = 0x5ca1ab1e0ddba11ull;
+  static inline long live = 0;
+
+  uint64_t value;
+  uint64_t pad[6] = {};
+  uint64_t canary = kCanary;
+
+  explicit Tracked(uint64_t v) : value(v) { live++; }
+  Tracked(const Tracked&) = delete;
+  ~Tracked() {
+    live--;
+    canary = 0;
+  }
+};
+
+inline auto Payload(uint64_t& obj) -> uint64_t& { return obj; }
+inline auto Payload(Tracked& obj) -> uint64_t& { return obj.value; }
+inline bool Intact(const uint64_t&) { return true; }
+inline bool Intact(const Tracked& obj) { return obj.canary == Tracked::kCanary; }
+
+[[noreturn]] inline void Fail(const std::string& what) { throw std::logic_error(what); }
+
+/**
+ * @brief Table of Pointers to objects of one type, mirrored by a reference model of the objects
+ * they refer to: their value, tenant and number of references.
+ */
+template <typename Tobj>
+class Model {
+public:
+  static constexpr size_t kRefs = 64;
+  static constexpr memman::TenantId kTenants = 3;
+
+  Model() : refs_(kRefs) {}
+  ~Model() { Clear(); }
+
+  /**
+   * @brief Applies one operation to the table and the model.
+   *
+   * @param op Operation, taken modulo the number of operations.
+   * @param a Destination entry, or the value of an allocation.
+   * @param b Source entry.
+   */
+  void Step(uint8_t op, uint32_t a, uint32_t b) {
+    size_t dst = a % kRefs;
+    size_t src = b % kRefs;
+    switch (op % 9) {
+    case 0:
+      Allocate(dst, a, 0);
+      break;
+    case 1:
+      Allocate(dst, a, 1 + b % kTenants);
+      break;
+    case 2:
+      refs_[dst].ptr = refs_[src].ptr;
+      Rebind(dst, refs_[src].id);
+      break;
+    case 3: {
+      memman::Pointer<Tobj> copy(refs_[src].ptr);
+      refs_[dst].ptr = std::move(copy);
+      Rebind(dst, refs_[src].id);
+      break;
+    }
+    case 4:
+      refs_[dst].ptr = std::move(refs_[src].ptr);
+      Move(dst, src);
+      break;
+    case 5: {
+      memman::Pointer<Tobj> moved(std::move(refs_[src].ptr));
+      refs_[dst].ptr = std::move(moved);
+      Move(dst, src);
+      break;
+    }
+    case 6:
+      refs_[dst].ptr = memman::Pointer<Tobj>();
+      Rebind(dst, 0);
+      break;
+    case 7:
+      if (refs_[dst].id != 0) {
+        Payload(*refs_[dst].ptr) = b;
+        objects_[refs_[dst].id].value = b;
+      }
+      break;
+    default:
+      CheckValues();
+      break;
+    }
+  }
+
+  /**
+   * @brief Checks every referenced object still holds its value. Right after a sweep, also checks
+   * the manager holds exactly the objects the model has references to.
+   */
+  void Check(bool swept) {
+    CheckValues();
+    if (!swept)
+      return;
+    auto stats = memman::memory_stats().types[typeid(Tobj).name()];
+    if (stats.objects != objects_.size())
+      Fail(std::string(typeid(Tobj).name()) + ": " + std::to_string(stats.objects) + " objects after a sweep, model has "
+        + std::to_string(objects_.size()));
+    if (std::is_same<Tobj, Tracked>::value && size_t(Tracked::live) != objects_.size())
+      Fail(std::to_string(Tracked::live) + " Tracked alive after a sweep, model has " + std::to_string(objects_.size()));
+  }
+
+  auto TenantObjects(memman::TenantId tenant) const -> size_t {
+    size_t n = 0;
+    for (auto& obj : objects_)
+      n += obj.second.tenant == tenant;
+    return n;
+  }
+
+  void Clear(void) {
+    for (size_t i = 0; i < kRefs; i++) {
+      refs_[i].ptr = memman::Pointer<Tobj>();
+      Rebind(i, 0);
+    }
+  }
+
+private:
+  struct Entry {
+    memman::Pointer<Tobj> ptr;
+    uint64_t id = 0;
+  };
+  struct Object {
+    size_t refs = 0;
+    uint64_t value = 0;
+    memman::TenantId tenant = 0;
+  };
+
+  std::vector<Entry> refs_;
+  std::unordered_map<uint64_t, Object> objects_;
+  uint64_t next_id_ = 1;
+
+  // An allocation refused at a limit leaves both the table and the model as they were.
+  void Allocate(size_t dst, uint64_t value, memman::TenantId tenant) {
+    try {
+      memman::TenantScope scope(tenant);
+      refs_[dst].ptr = memman::make_pointer<Tobj>(value);
+    }
+    catch (memman::MemoryLimitException&) {
+      return;
+    }
+    uint64_t id = next_id_++;
+    objects_[id] = Object{ 0, value, tenant };
+    Rebind(dst, id);
+  }
+
+  void Rebind(size_t dst, uint64_t id) {
+    if (id != 0)
+      objects_[id].refs++;
+    if (uint64_t old = refs_[dst].id; old != 0 && --objects_[old].refs == 0)
+      objects_.erase(old);
+    refs_[dst].id = id;
+  }
+
+  void Move(size_t dst, size_t src) {
+    if (dst == src)
+      return;
+    Rebind(dst, refs_[src].id);
+    Rebind(src, 0);
+  }
+
+  void CheckValues(void) {
+    for (auto& entry : refs_) {
+      if (entry.id == 0)
+        continue;
+      Tobj& obj = *entry.ptr;
+      if (!Intact(obj) || Payload(obj) != objects_[entry.id].value)
+        Fail(std::string(typeid(Tobj).name()) + ": object " + std::to_string(entry.id) + " was overwritten");
+    }
+  }
+};
+
+/**
+ * @brief Drives a model of a packed, trivially destructible type and one of a larger type with a
+ * destructor, sweeping in between and checking the tenant accounting of both.
+ */
+class Harness {
+public:
+  Harness() {
+    for (memman::TenantId t = 1; t <= Model<uint64_t>::kTenants; t++)
+      memman::set_tenant_quota(t, { 8 * sizeof(Tracked), 12 * sizeof(Tracked), memman::SweepPolicy::Own });
+    memman::set_type_quota<Tracked>({ 2 * CHUNK_SIZE, 3 * CHUNK_SIZE, memman::SweepPolicy::Own });
+  }
+
+  void Step(uint8_t op, uint32_t a, uint32_t b) {
+    if (op % 128 == 127) {
+      memman::sweep_memory();
+      Check(true);
+    }
+    else if (op & 0x80) {
+      tracked_.Step(op, a, b);
+    }
+    else {
+      words_.Step(op, a, b);
+    }
+  }
+
+  void Check(bool swept) {
+    words_.Check(swept);
+    tracked_.Check(swept);
+    if (!swept)
+      return;
+    auto stats = memman::memory_stats();
+    for (memman::TenantId t = 1; t <= Model<uint64_t>::kTenants; t++) {
+      size_t expected = words_.TenantObjects(t) + tracked_.TenantObjects(t);
+      if (stats.tenants[t].objects != expected)
+        Fail("tenant " + std::to_string(t) + " is charged " + std::to_string(stats.tenants[t].objects)
+          + " objects after a sweep, model has " + std::to_string(expected));
+    }
+  }
+
+private:
+  Model<uint64_t> words_;
+  Model<Tracked> tracked_;
+};
@@ -0,0 +1,155 @@
+#include "model.hpp"
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Persistent heap round trips, each run in a forked process since a type's heap opens only once
+ * per process: a list built, synced and killed is walked again from its root after a restart, and
+ * files of another type, with a broken checksum or changed after their last sync are rejected.
+ * Usage: persistent
+ */
+
+struct Node {
+  uint64_t value;
+  memman::Handle<Node> next;
+};
+
+struct Other {
+  uint64_t value[3];
+};
+
+static constexpr uint64_t kLength = 100;
+
+static auto Value(uint64_t i) -> uint64_t { return i * 0x9e3779b97f4a7c15ull; }
+
+// Runs step in a child, which reports failures on stderr and otherwise exits normally, closing its
+// heap, and returns its wait status.
+template <typename Step>
+static auto InChild(Step step) -> int {
+  pid_t child = fork();
+  if (child < 0)
+    Fail("cannot fork");
+  if (child == 0) {
+    try {
+      step();
+    }
+    catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      _exit(1);
+    }
+    exit(0);
+  }
+  int status = 0;
+  waitpid(child, &status, 0);
+  return status;
+}
+
+static bool Killed(int status) { return WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM; }
+static bool Exited(int status) { return WIFEXITED(status) && WEXITSTATUS(status) == 0; }
+
+// Builds the list front to back under the root, syncs, then optionally changes the heap before
+// being killed, which skips every destructor. Mapped chunks take whole pages, so the list spans
+// several of them only past the small heap of the stress builds.
+static void Build(const std::string& path, bool change_after_sync) {
+  memman::set_memory_limits(~size_t(0), ~size_t(0));
+  memman::open_persistent_heap<Node>(path);
+  memman::Handle<Node> next;
+  for (uint64_t i = kLength; i-- > 0;) {
+    auto node = memman::make_pointer<Node>();
+    (*node).value = Value(i);
+    (*node).next = next;
+    next = memman::pin(node);
+  }
+  memman::set_persistent_root(next);
+  memman::sync_persistent_heap<Node>();
+  if (change_after_sync)
+    memman::make_pointer<Node>();
+  raise(SIGTERM);
+}
+
+static void Walk(const std::string& path) {
+  memman::open_persistent_heap<Node>(path);
+  uint64_t i = 0;
+  for (auto h = memman::persistent_root<Node>(); !h.IsNull(); h = (*memman::resolve(h)).next, i++)
+    if ((*memman::resolve(h)).value != Value(i))
+      Fail("list node " + std::to_string(i) + " lost its value");
+  if (i != kLength)
+    Fail("list lost nodes: " + std::to_string(i) + " left");
+}
+
+// Opening must fail with an error mentioning reason.
+template <typename Tobj>
+static void Reject(const std::string& path, const char* reason) {
+  try {
+    memman::open_persistent_heap<Tobj>(path);
+  }
+  catch (memman::PersistentHeapException& e) {
+    if (std::strstr(e.what(), reason) == nullptr)
+      Fail(std::string("rejected for the wrong reason: ") + e.what());
+    return;
+  }
+  Fail(std::string("file was not rejected: ") + reason);
+}
+
+// Flips a bit of the first chunk's occupied bitmap, right after the header page.
+static void Corrupt(const std::string& path) {
+  int fd = open(path.c_str(), O_RDWR);
+  unsigned char byte = 0;
+  off_t offset = sysconf(_SC_PAGESIZE);
+  if (fd < 0 || pread(fd, &byte, 1, offset) != 1)
+    Fail("cannot read heap file");
+  byte ^= 0x80;
+  if (pwrite(fd, &byte, 1, offset) != 1)
+    Fail("cannot write heap file");
+  close(fd);
+}
+
+static void Run(const std::string& dir) {
+  std::string path = dir + "/list.heap";
+  if (!Killed(InChild([&] { Build(path, false); })))
+    Fail("builder was not killed");
+  if (!Exited(InChild([&] { Walk(path); })))
+    Fail("list was not restored after a kill");
+  // The walk exited normally, so the file was closed cleanly and opens once more.
+  if (!Exited(InChild([&] { Walk(path); })))
+    Fail("list was not restored after a normal exit");
+  if (!Exited(InChild([&] { Reject<Other>(path, "another type or layout"); })))
+    Fail("file of another type was opened");
+
+  std::string dirty = dir + "/dirty.heap";
+  if (!Killed(InChild([&] { Build(dirty, true); })))
+    Fail("builder was not killed");
+  if (!Exited(InChild([&] { Reject<Node>(dirty, "not closed cleanly"); })))
+    Fail("file changed after its last sync was opened");
+
+  Corrupt(path);
+  if (!Exited(InChild([&] { Reject<Node>(path, "checksum mismatch"); })))
+    Fail("corrupted file was opened");
+
+  unlink(path.c_str());
+  unlink(dirty.c_str());
+}
+
+int
+main() {
+  char dir[] = "/tmp/persistentXXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    std::cerr << "persistent failed: cannot create a directory" << std::endl;
+    return 1;
+  }
+  try {
+    Run(dir);
+  }
+  catch (std::exception& e) {
+    rmdir(dir);
+    std::cerr << "persistent failed: " << e.what() << std::endl;
+    return 1;
+  }
+  rmdir(dir);
+  std::cout << "persistent passed" << std::endl;
+
+  return 0;
+}
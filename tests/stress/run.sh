@@ -0,0 +1,51 @@
+#!/bin/bash
+# Builds and runs the stress harness with small chunks and heap, so that sweeps and limits are hit
+# often: plain, under ASan/UBSan with hardening, and under TSan, all with the shared pool. Then runs
+# the coroutine test under ASan/UBSan and the persistent heap test plain and under ASan/UBSan with
+# hardening, replays random inputs through the fuzz target, and fuzzes it
+# for a minute when clang++ is available.
+# Usage: ./run.sh [seed]
+
+set -e
+seed=${1:-1}
+flags="-std=c++17 -O1 -g -DCHUNK_SIZE_KB=1 -DHEAP_SIZE_KB=8 -DCHECK_INVARIANTS"
+
+for config in "-DSHARED_POOL" "-fsanitize=address,undefined -DHARDENED -DSHARED_POOL" "-fsanitize=thread -DSHARED_POOL";
+do
+  echo "g++ $flags $config stress.cpp -o stress.out"
+  g++ $flags $config stress.cpp -o stress.out -lpthread
+  ./stress.out "$seed"
+done
+rm stress.out
+
+echo "g++ $flags -std=c++20 -fsanitize=address,undefined coroutines.cpp -o coroutines.out"
+g++ $flags -std=c++20 -fsanitize=address,undefined coroutines.cpp -o coroutines.out
+./coroutines.out
+rm coroutines.out
+
+for config in "-DPERSISTENT_HEAP" "-fsanitize=address,undefined -DHARDENED -DPERSISTENT_HEAP";
+do
+  echo "g++ $flags $config persistent.cpp -o persistent.out"
+  g++ $flags $config persistent.cpp -o persistent.out
+  ./persistent.out
+done
+rm persistent.out
+
+echo "g++ $flags -fsanitize=address,undefined -DSTANDALONE_FUZZER fuzz_mem_man.cpp -o fuzz.out"
+g++ $flags -fsanitize=address,undefined -DSTANDALONE_FUZZER fuzz_mem_man.cpp -o fuzz.out
+corpus=$(mktemp -d)
+for i in $(seq 1 20);
+do
+  head -c $((i * 500)) /dev/urandom > "$corpus/random-$i"
+done
+./fuzz.out "$corpus"/*
+rm fuzz.out
+
+if command -v clang++ > /dev/null;
+then
+  echo "clang++ $flags -fsanitize=fuzzer,address,undefined fuzz_mem_man.cpp -o fuzz.out"
+  clang++ $flags -fsanitize=fuzzer,address,undefined fuzz_mem_man.cpp -o fuzz.out
+  ./fuzz.out -max_total_time=60 "$corpus"
+  rm fuzz.out
+fi
+rm -r "$corpus"
@@ -0,0 +1,212 @@
+#include "model.hpp"
+#include <random>
+#include <mutex>
+#include <cstring>
+#ifdef SHARED_POOL
+#include <sys/wait.h>
+#endif
+
+/**
+ * Seeded stress test: random allocation, copy, move and release sequences checked against the
+ * reference model in model.hpp, then, with SHARED_POOL, threads handing shared objects to each
+ * other and a forked consumer adopting objects a producer shares over a pipe.
+ * Usage: stress [seed] [steps] [threads]
+ */
+
+static void RunModel(uint64_t seed, size_t steps) {
+  std::mt19937_64 rng(seed);
+  Harness harness;
+  for (size_t i = 0; i < steps; i++) {
+    uint64_t r = rng();
+    harness.Step(uint8_t(r), uint32_t(r >> 8) & 0xffffff, uint32_t(r >> 32));
+    if (i % 64 == 0)
+      harness.Check(false);
+  }
+  memman::sweep_memory();
+  harness.Check(true);
+}
+
+#ifdef SHARED_POOL
+struct Message {
+  uint64_t producer;
+  uint64_t seq;
+  uint64_t check;
+};
+
+static auto Signature(uint64_t producer, uint64_t seq) -> uint64_t { return (producer * 0x9e3779b97f4a7c15ull) ^ seq; }
+
+// Every slot can be allocated exactly once when no references are left.
+static void CheckAllFree(memman::SharedPool<Message>& pool) {
+  std::vector<memman::SharedPointer<Message>> all;
+  for (size_t i = 0; i < pool.Capacity(); i++)
+    all.push_back(pool.Allocate(Message{}));
+  try {
+    pool.Allocate(Message{});
+  }
+  catch (memman::MemoryLimitException&) {
+    return;
+  }
+  Fail("shared pool handed out more objects than its capacity");
+}
+
+// Threads allocate messages, post copies to a shared mailbox, take other threads' messages and
+// drop them in random order. Once all are gone every slot must be free again.
+static void RunSharedPool(uint64_t seed, size_t steps, size_t threads) {
+  memman::SharedPool<Message> pool(size_t(1));
+  std::mutex lock;
+  std::vector<memman::SharedPointer<Message>> mailbox;
+
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      std::mt19937_64 rng(seed + t);
+      std::vector<memman::SharedPointer<Message>> held;
+      for (uint64_t seq = 0; seq < steps; seq++) {
+        uint64_t r = rng();
+        switch (r % 5) {
+        case 0:
+          try {
+            auto msg = pool.Allocate(Message{ t, seq, Signature(t, seq) });
+            held.push_back(std::move(msg));
+          }
+          catch (memman::MemoryLimitException&) {
+          }
+          break;
+        case 1:
+          if (!held.empty()) {
+            std::lock_guard<std::mutex> guard(lock);
+            mailbox.push_back(held[r / 5 % held.size()]);
+          }
+          break;
+        case 2: {
+          std::lock_guard<std::mutex> guard(lock);
+          if (!mailbox.empty()) {
+            held.push_back(std::move(mailbox.back()));
+            mailbox.pop_back();
+          }
+          break;
+        }
+        case 3:
+          if (!held.empty()) {
+            std::swap(held[r / 5 % held.size()], held.back());
+            held.pop_back();
+          }
+          break;
+        default:
+          for (auto& msg : held) {
+            if (msg->check != Signature(msg->producer, msg->seq))
+              Fail("shared message was overwritten");
+          }
+          break;
+        }
+        if (held.size() > 16)
+          held.erase(held.begin());
+      }
+    });
+  }
+  for (auto& worker : workers)
+    worker.join();
+  mailbox.clear();
+  CheckAllFree(pool);
+}
+
+// Allocates and drops messages until stopped, competing with the producer or consumer of its process.
+static void Churn(memman::SharedPool<Message>& pool, uint64_t seed, const std::atomic<bool>& stop) {
+  std::mt19937_64 rng(seed);
+  std::vector<memman::SharedPointer<Message>> held;
+  for (uint64_t seq = 0; !stop.load(std::memory_order_relaxed); seq++) {
+    try {
+      held.push_back(pool.Allocate(Message{ ~uint64_t(0), seq, Signature(~uint64_t(0), seq) }));
+    }
+    catch (memman::MemoryLimitException&) {
+    }
+    if (held.size() > rng() % 8) {
+      if (held.front()->check != Signature(held.front()->producer, held.front()->seq))
+        Fail("churned message was overwritten");
+      held.erase(held.begin());
+    }
+  }
+}
+
+// A forked consumer adopts the messages a producer shares over a pipe, while a thread in each
+// process allocates from the same pool. Once both are done every slot must be free again.
+static void RunSharedPoolProcesses(uint64_t seed, size_t messages) {
+  memman::SharedPool<Message> pool(size_t(1));
+  int handles[2];
+  if (pipe(handles) != 0)
+    Fail("cannot create pipe");
+
+  pid_t child = fork();
+  if (child < 0)
+    Fail("cannot fork");
+  std::atomic<bool> stop{ false };
+  std::thread churn(Churn, std::ref(pool), seed + (child == 0), std::cref(stop));
+  int status = 0;
+  if (child == 0) {
+    close(handles[1]);
+    memman::SharedHandle h;
+    uint64_t expected = 0;
+    try {
+      while (read(handles[0], &h, sizeof(h)) == sizeof(h)) {
+        auto msg = pool.Adopt(h);
+        if (msg->producer != 0 || msg->seq != expected++ || msg->check != Signature(0, msg->seq))
+          status = 1;
+      }
+    }
+    catch (memman::MemoryException&) {
+      status = 1;
+    }
+    stop = true;
+    churn.join();
+    _exit(status != 0 || expected != messages);
+  }
+
+  close(handles[0]);
+  for (uint64_t seq = 0; seq < messages; seq++) {
+    for (;;) {
+      try {
+        auto msg = pool.Allocate(Message{ 0, seq, Signature(0, seq) });
+        memman::SharedHandle h = pool.Share(msg);
+        if (write(handles[1], &h, sizeof(h)) != sizeof(h))
+          Fail("cannot write to pipe");
+        break;
+      }
+      catch (memman::MemoryLimitException&) {
+        std::this_thread::yield(); // Wait for the consumer to release some
+      }
+    }
+  }
+  close(handles[1]);
+  waitpid(child, &status, 0);
+  stop = true;
+  churn.join();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    Fail("consumer process saw a broken message");
+  CheckAllFree(pool);
+}
+#endif
+
+int
+main(int argc, char const* argv[]) {
+  uint64_t seed = argc > 1 ? std::stoull(argv[1]) : 1;
+  size_t steps = argc > 2 ? std::stoull(argv[2]) : 200000;
+  size_t threads = argc > 3 ? std::stoull(argv[3]) : 4;
+
+  try {
+    RunModel(seed, steps);
+#ifdef SHARED_POOL
+#ifndef __SANITIZE_THREAD__ // TSan cannot see slots handed over through the other process's atomics
+    RunSharedPoolProcesses(seed, steps / 10);
+#endif
+    RunSharedPool(seed, steps / 10, threads);
+#endif
+  }
+  catch (std::exception& e) {
+    std::cerr << "stress failed with seed " << seed << ": " << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << "stress passed with seed " << seed << std::endl;
+  (void)threads;
+
+  return 0;
+}